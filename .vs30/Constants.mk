@@ -58,13 +58,9 @@ STATIC =
 # clean up as you go).
 #
 # NOTE: If you try to make the 7.5c map and run into memory problems
-# (and you very likely will), see the file "75_commands.bash" in the 
-# Slope directory for a way to make the map in two pieces and then
-# stitch it together. If that's still too big for your machine, you
-# can follow the pattern there and split the map into four or more
-# pieces. I didn't build any of this into the Makefile because it's
-# just too complicated and a couple of years from now everyone is 
-# going to have a machine that can handle the full grid.
+# (and you very likely will), set TILED (below) to true and the Slope
+# Makefile will build the global map in overlapping tiles sized to 
+# fit in TILE_MEM_GB.
 #
 RES = 30
 RES_DD = 0.00833333333333
@@ -113,6 +109,67 @@ UNCERT_CPT = ../Misc/uncert.cpt
 #
 WATER = 600
 
+#
+# The number of worker threads the C programs in src may use
+# (0 means one per processor)
+#
+NTHREADS = 0
+
+#
+# grad2vs30 and vs30amp read, convert, and write their grids this
+# many rows at a time, so their memory use doesn't grow with the size
+# of the map
+# (0 reads the whole grids into memory)
+#
+BAND_ROWS = 1000
+
+#
+# The finished maps (global_vs30.grd and the amplification maps) are
+# written as netCDF-4 grids stored in NC_CHUNK x NC_CHUNK tiles, each
+# compressed at level NC_DEFLATE (0-9), so that a program that reads
+# a region or a point out of them only reads and uncompresses the
+# tiles it needs
+#
+NC_CHUNK = 256
+NC_DEFLATE = 3
+
+#
+# Set VS30_SHORT to store the Vs30 maps (Slope/global_vs30.grd, the
+# final global_vs30.grd, and global_vs30.bin) as scaled 16-bit
+# integers, half the size of floats. The setting below holds 0.0625
+# to 4095.94 m/s in steps of 1/16 m/s, so a value comes back within
+# 1/32 m/s of what it was, and whole numbers (the water velocity and
+# the special values 601 and 603) come back exactly; NaN is stored
+# as -32768. WEIGHTS_SHORT does the same for the regional weights.grd
+# files (0 to 1, to within 1.6e-5, with 0, 0.5, and 1 exact). The
+# programs in src stop with an error rather than store values that
+# don't fit. Leave them empty to store floats.
+#
+VS30_SHORT =
+#VS30_SHORT = +s0.0625+o2048+n-32768
+WEIGHTS_SHORT =
+#WEIGHTS_SHORT = +s3.0517578125e-05+o0.5+n-32768
+
+#
+# Set TILED to true to build the global slope-based map in overlapping
+# longitude tiles (see Slope/tiled_vs30.bash); the tiles are sized so
+# that TILE_JOBS of them, built at the same time, fit in about 
+# TILE_MEM_GB gigabytes of memory
+#
+TILED = false
+TILE_MEM_GB = 8
+TILE_JOBS = 2
+
+#
+# Set INCREMENTAL to true to have the top-level Makefile update the
+# global map in place, redoing only the regions that have changed
+# since the last build (see insert_grd in src/README). The build then
+# ends with a native binary map, global_vs30.bin; only the insertion
+# is faster, and "make netcdf" still converts all of it to the
+# compressed global_vs30.grd
+#
+INCREMENTAL = false
+
 #
 # Taiwan map: Pick one or the other map to insert.
 # According to Eric Thompson:
@@ -138,6 +195,24 @@ TW_GRD_FILE = Taiwan_Vs30_PRG_30c.grd
 #
 IRES = $(RES)
 
+#
+# The GMT grid formats that VS30_SHORT and WEIGHTS_SHORT (above) lead
+# to: netCDF shorts for the .grd files, and native binary shorts (or
+# floats) for global_vs30.bin
+#
+ifneq ($(VS30_SHORT),)
+VS30_NC = =ns$(VS30_SHORT)
+VS30_BIN = =bs$(VS30_SHORT)
+else
+VS30_NC =
+VS30_BIN = =bf
+endif
+ifneq ($(WEIGHTS_SHORT),)
+WEIGHTS_NC = =ns$(WEIGHTS_SHORT)
+else
+WEIGHTS_NC =
+endif
+
 #
 # GRES is the resolution string that is found in the file names
 # on the GMTED2010 site
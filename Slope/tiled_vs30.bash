@@ -0,0 +1,184 @@
+#!/bin/bash
+#
+# Build the global slope-based Vs30 map (without the Greenland fix)
+# in overlapping longitude tiles, so that no step ever has to hold
+# the whole global grid in memory. This replaces the old hand-split
+# 75_commands.bash and works at any resolution; the Makefile runs it
+# when TILED = true in Constants.mk:
+#
+#	% make
+#
+# Each tile is a strip running the full height of the map. Its core
+# is widened on both sides by an overlap of GLOBE_FX/2 + 2 grid points:
+# enough for the craton smoothing filter (GLOBE_FX/2), the gradient
+# stencil (1), and the pixel-to-gridline resampling (1). The DEM and
+# the cratons are cut from the global rasters a tile at a time; the
+# overlaps of the tiles at the edges of the map run past the 180 
+# degree meridian and wrap around to the other side of the globe, so
+# that the edge columns see the same neighbors they do in the global
+# grid (where grdgradient -fg and smooth periodic_x=1 wrap around). 
+# Each tile then goes through the same chain as the global
+# Makefile (grdgradient, smooth, grdlandmask, grad2vs30), TILE_JOBS
+# tiles at a time, and ../src/paste_grd joins them a row at a time,
+# splitting each overlap down the middle (i.e., along the core
+# boundaries). Because the overlaps are wider than the reach of every
+# step, the pasted map matches the untiled one except for roundoff in
+# the running sums of smooth.
+#
+# The number of tiles is the smallest that keeps each tile within
+# TILE_MEM_GB / TILE_JOBS gigabytes, assuming about BYTES_PER_NODE
+# bytes per grid point for the largest step (grdgradient or smooth).
+#
+# Usage (the settings come from the environment; the Makefile sets them):
+#
+#	bash tiled_vs30.bash			-- build all tiles and paste them
+#	bash tiled_vs30.bash tile K		-- build tile K (0, 1, ...) only
+#
+
+set -e
+
+: ${RES:?} ${GRES:?} ${RES_DD:?} ${GLOBE_FX:?} ${GLOBE_FY:?}
+: ${GXMIN:=-180} ${GYMIN:=-56} ${GYMAX:=84}
+: ${WATER:=600} ${NTHREADS:=0} ${BAND_ROWS:=1000}
+: ${TILE_MEM_GB:=8} ${TILE_JOBS:=1}
+: ${GDAL_PATH:=/usr/bin}
+: ${OUTPUT:=global_vs30_no_greenland.grd}
+
+BYTES_PER_NODE=20
+TILE_DIR=tiles
+SRC=../src
+
+#
+# Size of the global rasters in pixels, and of the output grid in
+# grid points (which sit on the pixel edges, so one more each way)
+#
+NXP=$(awk -v r=$RES 'BEGIN { printf "%d", 360 * 3600 / r + 0.5 }')
+NYP=$(awk -v r=$RES -v s=$GYMIN -v n=$GYMAX 'BEGIN { printf "%d", (n - s) * 3600 / r + 0.5 }')
+NY=$((NYP + 1))
+
+OV=$((GLOBE_FX / 2 + 2))
+
+MAXCOLS=$(awk -v m=$TILE_MEM_GB -v j=$TILE_JOBS -v b=$BYTES_PER_NODE -v ny=$NY \
+	'BEGIN { printf "%d", m * 1024 * 1024 * 1024 / (j * b * ny) }')
+CORE=$((MAXCOLS - 2 * OV))
+if [ $CORE -lt $OV ]; then
+	echo "TILE_MEM_GB=$TILE_MEM_GB is too small for $TILE_JOBS tiles at ${RES}c" 1>&2
+	exit 1
+fi
+NTILES=$(( (NXP + CORE - 1) / CORE ))
+
+# Longitude of grid point (or pixel edge) k
+lon() {
+	awk -v k=$1 -v r=$RES -v w=$GXMIN 'BEGIN { printf "%.10f", w + k * r / 3600 }'
+}
+
+#
+# pixels KIND S E SHIFT OUT: make a pixel-registered grid OUT from
+# pixels S to E-1 of the global DEM (KIND=dem) or craton (KIND=craton)
+# raster, labeled as if it started at pixel S+SHIFT
+#
+pixels() {
+	local kind=$1 s=$2 e=$3 shift=$4 out=$5
+	local region=$(lon $((s + shift)))/$(lon $((e + shift)))/$GYMIN/$GYMAX
+
+	if [ $kind = dem ]; then
+		$GDAL_PATH/gdal_translate -q -srcwin $s 0 $((e - s)) $NYP -of EHdr \
+			elev/md${GRES}_grd ${out%.grd}.bil
+		gmt xyz2grd ${out%.grd}.bil -ZTLh -r -R$region -I${RES}s -G$out
+	else
+		$GDAL_PATH/gdal_rasterize -q -burn 1 -of EHdr -init 0 \
+			-te $(lon $s) $GYMIN $(lon $e) $GYMAX -tr $RES_DD $RES_DD -ot Byte \
+			cratons/cratons_nshmp.shp ${out%.grd}.bil
+		gmt xyz2grd ${out%.grd}.bil -ZTLc -r -R$region -I${RES}s -G$out
+	fi
+	rm -f ${out%.grd}.bil ${out%.grd}.hdr ${out%.grd}.prj ${out%.grd}.aux.xml
+}
+
+#
+# nodes KIND A B OUT [-nn]: make a gridline-registered grid OUT for
+# grid points A to B, which may run past either edge of the map (they
+# wrap around); takes two extra pixels on each side so that the
+# resampling never sees the edge of what was cut out
+#
+nodes() {
+	local kind=$1 a=$2 b=$3 out=$4 interp=$5
+	local p0=$((a - 2)) p1=$((b + 2)) pieces="" piece
+
+	if [ $p0 -lt 0 ]; then
+		pixels $kind $((p0 + NXP)) $NXP -$NXP ${out%.grd}_w.grd
+		pieces="${out%.grd}_w.grd"
+		p0=0
+	fi
+	pixels $kind $p0 $((p1 < NXP ? p1 : NXP)) 0 ${out%.grd}_m.grd
+	pieces="$pieces ${out%.grd}_m.grd"
+	if [ $p1 -gt $NXP ]; then
+		pixels $kind 0 $((p1 - NXP)) $NXP ${out%.grd}_e.grd
+		pieces="$pieces ${out%.grd}_e.grd"
+	fi
+
+	set -- $pieces
+	cp $1 ${out%.grd}_px.grd
+	shift
+	for piece in "$@"; do
+		gmt grdpaste ${out%.grd}_px.grd $piece -G${out%.grd}_tmp.grd
+		mv ${out%.grd}_tmp.grd ${out%.grd}_px.grd
+	done
+
+	gmt grdsample ${out%.grd}_px.grd -G${out%.grd}_nd.grd -T -fg $interp
+	gmt grdcut ${out%.grd}_nd.grd -R$(lon $a)/$(lon $b)/$GYMIN/$GYMAX -G$out
+	rm -f $pieces ${out%.grd}_px.grd ${out%.grd}_nd.grd
+}
+
+#
+# Build tile K: its core is grid points C0 to C1 and, with the
+# overlap, it covers E0 to E1 (which may run past the edges of the
+# map); its output is cut back to the map, X0 to X1
+#
+build_tile() {
+	local k=$1
+	local c0=$((k * NXP / NTILES)) c1=$(((k + 1) * NXP / NTILES))
+	local e0=$((c0 - OV)) e1=$((c1 + OV))
+	local x0=$((e0 > 0 ? e0 : 0)) x1=$((e1 < NXP ? e1 : NXP))
+	local region=$(lon $e0)/$(lon $e1)/$GYMIN/$GYMAX
+	local t=$TILE_DIR/t$k
+
+	echo "Tile $k of $NTILES: grid points $e0 to $e1 ($region)"
+
+	# The slope needs one more grid point on each side for the stencil
+	nodes dem $((e0 - 1)) $((e1 + 1)) ${t}_dem.grd
+	gmt grdgradient ${t}_dem.grd -n+bg -fg -D -S${t}_grad_ext.grd -G${t}_junk.grd
+	gmt grdcut ${t}_grad_ext.grd -R$region -G${t}_grad.grd
+	rm -f ${t}_dem.grd ${t}_grad_ext.grd ${t}_junk.grd
+
+	nodes craton $e0 $e1 ${t}_cratons.grd -nn
+	$SRC/smooth infile=${t}_cratons.grd fx=$GLOBE_FX fy=$GLOBE_FY \
+		outfile=${t}_cratons_smooth.grd threads=$NTHREADS
+	rm -f ${t}_cratons.grd
+
+	gmt grdlandmask -R$region -I${RES}s -G${t}_landmask.grd -Df
+
+	$SRC/grad2vs30 gradient_file=${t}_grad.grd craton_file=${t}_cratons_smooth.grd \
+		landmask_file=${t}_landmask.grd output_file=${t}_vs30_ext.grd \
+		water=$WATER threads=$NTHREADS band_rows=$BAND_ROWS
+	rm -f ${t}_grad.grd ${t}_cratons_smooth.grd ${t}_landmask.grd
+
+	gmt grdcut ${t}_vs30_ext.grd -R$(lon $x0)/$(lon $x1)/$GYMIN/$GYMAX -G${t}_vs30.grd
+	rm -f ${t}_vs30_ext.grd
+}
+
+if [ "$1" = tile ]; then
+	build_tile $2
+	exit 0
+fi
+
+mkdir -p $TILE_DIR
+echo "Building $OUTPUT in $NTILES tiles of about $CORE + 2 x $OV columns, $TILE_JOBS at a time"
+
+seq 0 $((NTILES - 1)) | xargs -P $TILE_JOBS -I{} bash $0 tile {}
+
+TILES=""
+for k in $(seq 0 $((NTILES - 1))); do
+	TILES="$TILES tile$((k + 1))=$TILE_DIR/t${k}_vs30.grd"
+done
+$SRC/paste_grd outfile=$OUTPUT $TILES
+rm -rf $TILE_DIR
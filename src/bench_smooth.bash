@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Time the scanline and separable engines of smooth against each
+# other, with and without repriming of the running sums (reprime),
+# on full-width global grids at 30c and 7.5c, with the filter
+# sizes the global maps use (GLOBE_FX x GLOBE_FY in Constants.mk).
+# The cost of both engines goes with the width of the grid times the
+# number of rows, so rather than the whole globe the test grid is a
+# band of ROWS rows spanning all 360 degrees, filled with a pattern
+# of values like a DEM (in the thousands, where float sums lose the
+# most). From this directory:
+#
+#	% make bench
+#
+# or, for other resolutions, filter sizes, or thread counts:
+#
+#	% RUNS="30:239 15:479 7.5:959" ROWS=4000 THREADS="1 8" bash bench_smooth.bash
+#
+# Each run reports the time spent filtering (not reading and writing)
+# and the largest error at VERIFY random points, relative to the
+# largest value in the box, against the box average computed directly
+# in double precision; if it's bigger than TOLERANCE the script stops
+# with an error.
+#
+
+set -e -o pipefail
+
+: ${RUNS:="30:239 7.5:959"}
+: ${ROWS:=2000}
+: ${THREADS:="1 0"}
+: ${VERIFY:=200}
+: ${TOLERANCE:=1e-5}
+: ${BENCH_DIR:=/tmp/bench_smooth.$$}
+
+mkdir -p $BENCH_DIR
+trap "rm -rf $BENCH_DIR" EXIT
+
+for run in $RUNS; do
+	res=${run%:*}
+	f=${run#*:}
+	top=$(awk -v r=$res -v n=$ROWS 'BEGIN { printf "%.10f", (n - 1) * r / 3600 }')
+
+	echo "${res}c: $(awk -v r=$res 'BEGIN { printf "%d", 360 * 3600 / r + 1 }') x $ROWS grid, ${f} x ${f} filter"
+	gmt grdmath -R-180/180/0/$top -I${res}s X 7 MUL SIN Y 11 MUL COS MUL \
+		1000 MUL 5000 ADD = $BENCH_DIR/in.grd
+
+	for t in $THREADS; do
+		for engine in scanline separable; do
+			for reprime in 0 $((4 * f)); do
+				./smooth infile=$BENCH_DIR/in.grd outfile=$BENCH_DIR/out.grd \
+					fx=$f fy=$f engine=$engine threads=$t reprime=$reprime \
+					verify=$VERIFY tolerance=$TOLERANCE 2>&1 | \
+					awk -v l="threads=$t $engine reprime=$reprime" \
+					'/^Filtered/ { s = $(NF-1) } /^Largest/ { e = $(NF-2) } 
+					 /^Verification failed/ { e = e " (over tolerance)" }
+					 END { printf "  %-36s %8.3f s, max error %s\n", l, s, e }'
+			done
+		done
+	done
+	rm -f $BENCH_DIR/*.grd
+done
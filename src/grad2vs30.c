@@ -1,14 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <locale.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 #include <gmt.h>
 
 #include "libget.h"
+#include "grdutil.h"
+#include "ncformat.h"
 
 /*
  * grad2vs30: convert topographic slope to Vs30
@@ -27,6 +38,31 @@
  * 600.
  * The output file name is specified with "output_file"
  * (required).
+ * The optional argument "threads" sets the number of worker
+ * threads the rows are split across (default 1; 0 means one
+ * per processor). Every output point depends only on the
+ * input points at the same location, so the output is
+ * identical no matter how many threads are used.
+ * The optional argument "simd" picks the code path for the
+ * conversion: "auto" (the default) uses the widest of AVX-512,
+ * AVX2, or plain C that the processor supports; "avx512",
+ * "avx2", and "none" force one of them. All of them produce
+ * identical output.
+ * The optional argument "band_rows" turns on band mode: instead
+ * of reading all three grids into memory, band_rows rows of each
+ * are read, converted, and written at a time, so the memory used 
+ * is about 16 * band_rows * (number of columns) bytes no matter 
+ * how large the grids are. The default (0) reads the whole grids.
+ * The optional "chunk" and "deflate" set the tiling and compression
+ * of a netCDF output_file (see ncformat.c).
+ * Instead of gradient_file, "dem_file" may give the elevation (in
+ * meters, on geographic coordinates); the slope is then computed
+ * from it as the rows go by, the way "gmt grdgradient -fg -n+bg -S"
+ * does (see slopeRow), so the gradient never has to be written out.
+ * In band mode a band of the DEM takes the place of the band of the
+ * gradient, plus a row above and below it. The optional "earth_radius"
+ * (meters) is the radius used to turn degrees into meters; the
+ * default is GMT's (PROJ_MEAN_RADIUS=authalic, on WGS-84).
  */
 
 const float vs30_min = 180;
@@ -61,20 +97,476 @@ float craton_table[6][4] =
 /* 
  * Function interpVs30 interpolates (or extrapolates) vs30 from a
  * row of one of the tables (tables have already been log()'ed so
- * the exp() returns vs30 in linear units)
- * (I was going to pre-compute the differences (tt[1]-tt[0] and 
- * tt[3]-tt[2]) and make this function a #define for speed, but the
- * execution time is utterly dwarfed by the read/write times so there 
- * was no point.)
+ * the exp() returns vs30 in linear units); it is only used to fill
+ * the lookup table, below.
  */
 float interpVs30(float *tt, float lg) {
   return exp(tt[0] + (tt[1] - tt[0]) * (lg - tt[2]) / (tt[3] - tt[2]));
 }
 
+/*
+ * Function tableVs30 converts one log()'ed slope to vs30 using
+ * one of the (log()'ed) tables; slopes lower than the minimum or
+ * greater than the maximum in the table are extrapolated from the
+ * first or last row, respectively. The result is not capped by
+ * vs30_min and vs30_max -- capVs30 does that. Together they are the
+ * reference conversion, used to fill and check the lookup table below.
+ */
+float tableVs30(float (*table)[4], size_t nr, float lg) {
+  size_t j;
+
+  if (lg <= table[0][2]) {
+    return interpVs30(table[0],lg);
+  }
+  for (j = 0; j < nr - 1; j++) {
+    if (lg <= table[j][3]) {
+      return interpVs30(table[j],lg);
+    }
+  }
+  return interpVs30(table[nr-1],lg);
+}
+
+/* 
+ * Extrapolated values are capped by the minimum and maximum vs30 
+ * (this isn't necessary when the table contains the minimum vs30,
+ * but it's cheap insurance if we change the table or minimum)
+ */
+static inline float capVs30(float vv) {
+  vv = vv > vs30_min ? vv : vs30_min;
+  return vv < vs30_max ? vv : vs30_max;
+}
+
+/*
+ * The lookup table: rather than taking the log() of every slope, 
+ * searching the tables, and exp()'ing the result, we tabulate vs30 
+ * (craton and active) at slopes spaced evenly in the bits of the 
+ * IEEE float representation of the slope. The exponent and the top 
+ * LUT_SUB_BITS of the mantissa of a slope pick its bin (so the bins 
+ * are spaced 2^LUT_SUB_BITS to each factor of two, i.e., evenly in 
+ * log(slope)) and the rest of the mantissa is the linear position 
+ * within the bin. The nodes hold the uncapped values and the caps 
+ * are applied after interpolating, so the corners where the vs30 
+ * reaches vs30_min and vs30_max are exact. Slopes below 2^LUT_LOG2_MIN 
+ * or above 2^LUT_LOG2_MAX are clamped to the ends of the table, where 
+ * both tables are already beyond the caps (check_lut=1 verifies this). 
+ * A node is stored as {craton, active} so a lookup usually touches a
+ * single cache line. With 1024 bins per factor of two the largest 
+ * difference from the reference conversion is a few hundredths of a
+ * m/s, at the corners between rows of the tables; check_lut=1 checks
+ * it against LUT_TOLERANCE.
+ */
+#define LUT_LOG2_MIN  (-16)
+#define LUT_LOG2_MAX  (-2)
+#define LUT_SUB_BITS  10
+#define LUT_FRAC_BITS (23 - LUT_SUB_BITS)
+#define LUT_NODES     (((LUT_LOG2_MAX - LUT_LOG2_MIN) << LUT_SUB_BITS) + 1)
+#define LUT_BASE_BITS ((uint32_t)(127 + LUT_LOG2_MIN) << 23)
+#define LUT_TOLERANCE 0.05
+
+const float lut_gmin = 1.0 / (1 << -LUT_LOG2_MIN);
+const float lut_gmax = 1.0 / (1 << -LUT_LOG2_MAX);
+
+/* One extra node so a slope of exactly lut_gmax can read node + 1 */
+float vs30_lut[LUT_NODES + 1][2];
+
+typedef union {
+  float f;
+  uint32_t u;
+} fbits;
+
+void buildLUT(void) {
+  size_t k;
+  fbits g;
+
+  for (k = 0; k < LUT_NODES; k++) {
+    g.u = LUT_BASE_BITS + ((uint32_t)k << LUT_FRAC_BITS);
+    vs30_lut[k][0] = tableVs30(craton_table, rows_craton, log(g.f));
+    vs30_lut[k][1] = tableVs30(active_table, rows_active, log(g.f));
+  }
+  vs30_lut[LUT_NODES][0] = vs30_lut[LUT_NODES-1][0];
+  vs30_lut[LUT_NODES][1] = vs30_lut[LUT_NODES-1][1];
+}
+
+/*
+ * Function lookupVs30 returns the craton (tvs[0]) and active (tvs[1]) 
+ * vs30 for slope gg from the lookup table: no transcendentals and 
+ * no data-dependent branches (the clamps compile to min/max).
+ * A NaN slope gives NaN. A slope of zero (or less) is clamped to 
+ * the bottom of the table, just as log(0) = -inf fell below it.
+ */
+static inline void lookupVs30(float gg, float *tvs) {
+  fbits g;
+  uint32_t bin, ix;
+  float frac;
+
+  g.f = gg > lut_gmin ? gg : lut_gmin;
+  g.f = g.f < lut_gmax ? g.f : lut_gmax;
+  bin = g.u - LUT_BASE_BITS;
+  ix = bin >> LUT_FRAC_BITS;
+  frac = (float)(bin & ((1 << LUT_FRAC_BITS) - 1)) * (1.0f / (1 << LUT_FRAC_BITS));
+  tvs[0] = capVs30(vs30_lut[ix][0] + frac * (vs30_lut[ix+1][0] - vs30_lut[ix][0]));
+  tvs[1] = capVs30(vs30_lut[ix][1] + frac * (vs30_lut[ix+1][1] - vs30_lut[ix][1]));
+  if (gg != gg) {
+    tvs[0] = tvs[1] = NAN;
+  }
+}
+
+/*
+ * Function makeTables log()'s the tables and fills the lookup table
+ */
+void makeTables(void) {
+  size_t i;
+
+  /* 
+   * We're doing log-log interpolation, so log() everything in the 
+   * tables first, for efficiency 
+   */
+  for (i = 0; i < rows_active; i++) {
+    active_table[i][0] = log(active_table[i][0]);
+    active_table[i][1] = log(active_table[i][1]);
+    active_table[i][2] = log(active_table[i][2]);
+    active_table[i][3] = log(active_table[i][3]);
+  }
+  for (i = 0; i < rows_craton; i++) {
+    craton_table[i][0] = log(craton_table[i][0]);
+    craton_table[i][1] = log(craton_table[i][1]);
+    craton_table[i][2] = log(craton_table[i][2]);
+    craton_table[i][3] = log(craton_table[i][3]);
+  }
+  buildLUT();
+}
+
+/*
+ * Function checkLUT compares the lookup table against the reference
+ * conversion at slopes spaced finely in log(slope) from well below 
+ * to well above the tables, plus the table corners themselves, and 
+ * reports the largest differences; returns non-zero if either is 
+ * larger than LUT_TOLERANCE.
+ */
+int checkLUT(void) {
+  const size_t nsamp = 10000000;
+  const double lg_lo = log(1.0e-8), lg_hi = log(10.0);
+  double err[2] = {0, 0}, worst[2] = {0, 0};
+  float tvs[2], ref[2], gg;
+  size_t n, j;
+
+  for (n = 0; n <= nsamp + 2 * (rows_craton + rows_active); n++) {
+    if (n <= nsamp) {
+      gg = exp(lg_lo + (lg_hi - lg_lo) * n / nsamp);
+    } else {
+      j = (n - nsamp - 1) / 2;
+      if (j < rows_craton) {
+        gg = exp(craton_table[j][2 + (n - nsamp - 1) % 2]);
+      } else {
+        gg = exp(active_table[j - rows_craton][2 + (n - nsamp - 1) % 2]);
+      }
+    }
+    lookupVs30(gg, tvs);
+    ref[0] = capVs30(tableVs30(craton_table, rows_craton, log(gg)));
+    ref[1] = capVs30(tableVs30(active_table, rows_active, log(gg)));
+    for (j = 0; j < 2; j++) {
+      if (fabs(tvs[j] - ref[j]) > err[j]) {
+        err[j] = fabs(tvs[j] - ref[j]);
+        worst[j] = gg;
+      }
+    }
+  }
+  fprintf(stderr, "Lookup table max error: craton %g m/s (slope %g), "
+          "active %g m/s (slope %g); tolerance %g m/s\n",
+          err[0], worst[0], err[1], worst[1], LUT_TOLERANCE);
+  return err[0] > LUT_TOLERANCE || err[1] > LUT_TOLERANCE;
+}
+
+/*
+ * Function convertRowScalar converts one row (nx points) of slope 
+ * to vs30; it only reads the lookup table, so any number of threads
+ * can call it at once on different rows. The vector versions below 
+ * do exactly the same float operations in the same order, so all 
+ * of them give identical results (the Makefile turns off fused 
+ * multiply-add contraction to keep it that way).
+ */
+void convertRowScalar(const float *grad, const float *land, const float *craton,
+                      float *vs30, size_t nx, float water) {
+  size_t i;
+  float tvs[2];
+
+  for (i = 0; i < nx; i++) {
+    /* Get the Vs30 for both craton and active */
+    lookupVs30(grad[i], tvs);
+
+    /* Do a weighted average of craton and active vs30 */
+    vs30[i] = craton[i] * tvs[0] + (1.0f - craton[i]) * tvs[1];
+
+    /* Set areas covered by water to the water value */
+    vs30[i] = land[i] == 0 ? water : vs30[i];
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * AVX2 version of convertRowScalar: 8 points at a time, with the
+ * lookup table read by gathers and the NaN and water cases handled
+ * by masked blends rather than branches (slopes off either end of
+ * the table are clamped just as in lookupVs30); the leftover points
+ * at the end of the row go through the scalar version.
+ */
+__attribute__((target("avx2")))
+void convertRowAVX2(const float *grad, const float *land, const float *craton,
+                    float *vs30, size_t nx, float water) {
+  const __m256 gmin = _mm256_set1_ps(lut_gmin);
+  const __m256 gmax = _mm256_set1_ps(lut_gmax);
+  const __m256 vmin = _mm256_set1_ps(vs30_min);
+  const __m256 vmax = _mm256_set1_ps(vs30_max);
+  const __m256 scale = _mm256_set1_ps(1.0f / (1 << LUT_FRAC_BITS));
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 wat = _mm256_set1_ps(water);
+  const __m256 nan = _mm256_set1_ps(NAN);
+  const __m256i base = _mm256_set1_epi32(LUT_BASE_BITS);
+  const __m256i fmask = _mm256_set1_epi32((1 << LUT_FRAC_BITS) - 1);
+  __m256 g, gc, frac, c0, c1, a0, a1, tc, ta, crat, out;
+  __m256i bin, ix;
+  size_t i;
+
+  for (i = 0; i + 8 <= nx; i += 8) {
+    g = _mm256_loadu_ps(grad + i);
+    gc = _mm256_min_ps(_mm256_max_ps(g, gmin), gmax);
+    bin = _mm256_sub_epi32(_mm256_castps_si256(gc), base);
+    ix = _mm256_slli_epi32(_mm256_srli_epi32(bin, LUT_FRAC_BITS), 1);
+    frac = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(bin, fmask)), scale);
+
+    c0 = _mm256_i32gather_ps(&vs30_lut[0][0], ix, 4);
+    a0 = _mm256_i32gather_ps(&vs30_lut[0][1], ix, 4);
+    c1 = _mm256_i32gather_ps(&vs30_lut[1][0], ix, 4);
+    a1 = _mm256_i32gather_ps(&vs30_lut[1][1], ix, 4);
+    tc = _mm256_add_ps(c0, _mm256_mul_ps(frac, _mm256_sub_ps(c1, c0)));
+    ta = _mm256_add_ps(a0, _mm256_mul_ps(frac, _mm256_sub_ps(a1, a0)));
+    tc = _mm256_min_ps(_mm256_max_ps(tc, vmin), vmax);
+    ta = _mm256_min_ps(_mm256_max_ps(ta, vmin), vmax);
+
+    crat = _mm256_loadu_ps(craton + i);
+    out = _mm256_add_ps(_mm256_mul_ps(crat, tc),
+                        _mm256_mul_ps(_mm256_sub_ps(one, crat), ta));
+    out = _mm256_blendv_ps(out, nan, _mm256_cmp_ps(g, g, _CMP_UNORD_Q));
+    out = _mm256_blendv_ps(out, wat,
+                  _mm256_cmp_ps(_mm256_loadu_ps(land + i), zero, _CMP_EQ_OQ));
+    _mm256_storeu_ps(vs30 + i, out);
+  }
+  convertRowScalar(grad + i, land + i, craton + i, vs30 + i, nx - i, water);
+}
+
+/*
+ * AVX-512 version of convertRowScalar: as above, 16 points at a time
+ */
+__attribute__((target("avx512f")))
+void convertRowAVX512(const float *grad, const float *land, const float *craton,
+                      float *vs30, size_t nx, float water) {
+  const __m512 gmin = _mm512_set1_ps(lut_gmin);
+  const __m512 gmax = _mm512_set1_ps(lut_gmax);
+  const __m512 vmin = _mm512_set1_ps(vs30_min);
+  const __m512 vmax = _mm512_set1_ps(vs30_max);
+  const __m512 scale = _mm512_set1_ps(1.0f / (1 << LUT_FRAC_BITS));
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 wat = _mm512_set1_ps(water);
+  const __m512 nan = _mm512_set1_ps(NAN);
+  const __m512i base = _mm512_set1_epi32(LUT_BASE_BITS);
+  const __m512i fmask = _mm512_set1_epi32((1 << LUT_FRAC_BITS) - 1);
+  __m512 g, gc, frac, c0, c1, a0, a1, tc, ta, crat, out;
+  __m512i bin, ix;
+  size_t i;
+
+  for (i = 0; i + 16 <= nx; i += 16) {
+    g = _mm512_loadu_ps(grad + i);
+    gc = _mm512_min_ps(_mm512_max_ps(g, gmin), gmax);
+    bin = _mm512_sub_epi32(_mm512_castps_si512(gc), base);
+    ix = _mm512_slli_epi32(_mm512_srli_epi32(bin, LUT_FRAC_BITS), 1);
+    frac = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_and_si512(bin, fmask)), scale);
+
+    c0 = _mm512_i32gather_ps(ix, &vs30_lut[0][0], 4);
+    a0 = _mm512_i32gather_ps(ix, &vs30_lut[0][1], 4);
+    c1 = _mm512_i32gather_ps(ix, &vs30_lut[1][0], 4);
+    a1 = _mm512_i32gather_ps(ix, &vs30_lut[1][1], 4);
+    tc = _mm512_add_ps(c0, _mm512_mul_ps(frac, _mm512_sub_ps(c1, c0)));
+    ta = _mm512_add_ps(a0, _mm512_mul_ps(frac, _mm512_sub_ps(a1, a0)));
+    tc = _mm512_min_ps(_mm512_max_ps(tc, vmin), vmax);
+    ta = _mm512_min_ps(_mm512_max_ps(ta, vmin), vmax);
+
+    crat = _mm512_loadu_ps(craton + i);
+    out = _mm512_add_ps(_mm512_mul_ps(crat, tc),
+                        _mm512_mul_ps(_mm512_sub_ps(one, crat), ta));
+    out = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(g, g, _CMP_UNORD_Q), out, nan);
+    out = _mm512_mask_blend_ps(
+              _mm512_cmp_ps_mask(_mm512_loadu_ps(land + i), zero, _CMP_EQ_OQ),
+              out, wat);
+    _mm512_storeu_ps(vs30 + i, out);
+  }
+  convertRowScalar(grad + i, land + i, craton + i, vs30 + i, nx - i, water);
+}
+#endif
+
+typedef void (*convert_fn)(const float *, const float *, const float *,
+                           float *, size_t, float);
+
+/*
+ * Function pickConvert returns the conversion for the requested
+ * simd path ("auto", "avx512", "avx2", or "none"), checking that
+ * the processor can actually run it
+ */
+convert_fn pickConvert(const char *simd) {
+  int want_auto = strcmp(simd, "auto") == 0;
+
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if ((want_auto || strcmp(simd, "avx512") == 0) &&
+      __builtin_cpu_supports("avx512f")) {
+    fprintf(stderr, "Using the AVX-512 conversion\n");
+    return convertRowAVX512;
+  }
+  if ((want_auto || strcmp(simd, "avx2") == 0) &&
+      __builtin_cpu_supports("avx2")) {
+    fprintf(stderr, "Using the AVX2 conversion\n");
+    return convertRowAVX2;
+  }
+#endif
+  if (!want_auto && strcmp(simd, "none") != 0) {
+    fprintf(stderr, "simd=%s is not available here, using plain C\n", simd);
+  }
+  return convertRowScalar;
+}
+
+/*
+ * Function openGrid reads the grid in path (either the whole thing
+ * or, depending on mode, just its header); exits if it can't
+ */
+struct GMT_GRID *openGrid(void *API, const char *path, unsigned int mode) {
+  struct GMT_GRID *G;
+
+  if ((G = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+				  GMT_IS_FILE, GMT_IS_SURFACE,
+				  mode, NULL, path, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't read %s\n", path);
+    exit(-1);
+  }
+  return G;
+}
+
+/*
+ * The slope from a DEM on geographic coordinates, the way gmt
+ * grdgradient -fg -n+bg -S computes it: the magnitude of the gradient
+ * by centered differences over the four neighbors of each point, with
+ * the degrees turned into meters on a sphere (so the east-west
+ * spacing shrinks with the cosine of the latitude). At the edges of
+ * the grid the missing neighbors are extrapolated linearly (GMT's
+ * natural boundary conditions), which makes the differences there
+ * one-sided, except that a grid that goes all the way around the
+ * globe wraps from east to west.
+ */
+#define EARTH_RADIUS 6371007.1809
+
+#define WRAP_NONE     0
+#define WRAP_GRIDLINE 1   /* the last column repeats the first */
+#define WRAP_PIXEL    2
+
+struct slopeGrid {
+  size_t nx, ny;
+  int wrap;
+  double lat0, dlat;    /* latitude of row 0, and the row spacing */
+  double mx, my;        /* meters between columns (at the equator) and rows */
+};
+
+/*
+ * Function slopeRow computes row "row" of the slope from the same row
+ * of the DEM ("here") and the rows above and below it (NULL at the
+ * north and south edges, respectively)
+ */
+void slopeRow(const struct slopeGrid *S, size_t row, const float *above,
+              const float *here, const float *below, float *grad) {
+  size_t i, nx = S->nx;
+  double xf, yf, dzdx, dzdy;
+  float west, east, north, south;
+
+  xf = 1 / (2 * S->mx * cos((S->lat0 - row * S->dlat) * M_PI / 180));
+  yf = 1 / (2 * S->my);
+  for (i = 0; i < nx; i++) {
+    if (i > 0) {
+      west = here[i - 1];
+    } else if (S->wrap == WRAP_GRIDLINE) {
+      west = here[nx - 2];
+    } else if (S->wrap == WRAP_PIXEL) {
+      west = here[nx - 1];
+    } else {
+      west = 2.0f * here[0] - here[1];
+    }
+    if (i < nx - 1) {
+      east = here[i + 1];
+    } else if (S->wrap == WRAP_GRIDLINE) {
+      east = here[1];
+    } else if (S->wrap == WRAP_PIXEL) {
+      east = here[0];
+    } else {
+      east = 2.0f * here[nx - 1] - here[nx - 2];
+    }
+    north = above != NULL ? above[i] : 2.0f * here[i] - below[i];
+    south = below != NULL ? below[i] : 2.0f * here[i] - above[i];
+    dzdx = (east - west) * xf;
+    dzdy = (north - south) * yf;
+    grad[i] = hypot(dzdx, dzdy);
+  }
+}
+
+/*
+ * Function slopeBand computes nrows rows of the slope, starting with
+ * row "row", into grad; "dem" is that row of the DEM, and must be
+ * preceded by the row above it and followed by the one below the
+ * last (where those are in the grid). The rows are split across the
+ * threads.
+ */
+void slopeBand(const struct slopeGrid *S, const float *dem, size_t row,
+               size_t nrows, float *grad, size_t nthreads) {
+  size_t m;
+
+#pragma omp parallel for schedule(dynamic, 16) num_threads(nthreads)
+  for (m = 0; m < nrows; m++) {
+    const float *here = dem + m * S->nx;
+
+    slopeRow(S, row + m, row + m > 0 ? here - S->nx : NULL, here,
+             row + m < S->ny - 1 ? here + S->nx : NULL, grad + m * S->nx);
+  }
+}
+
+/*
+ * Function convertBand converts nrows rows of nx points; the rows 
+ * are split across the threads, and the workers share a single 
+ * count of finished rows (ndone, out of total) so progress is 
+ * reported for the grid as a whole every "report" rows.
+ */
+void convertBand(convert_fn convertRow, const float *grad, const float *land,
+                 const float *craton, float *vs30, size_t nrows, size_t nx,
+                 float water, size_t nthreads, size_t *ndone, size_t total,
+                 size_t report) {
+  size_t m;
+
+#pragma omp parallel for schedule(dynamic, 16) num_threads(nthreads)
+  for (m = 0; m < nrows; m++) {
+    size_t done;
+
+    convertRow(grad + m * nx, land + m * nx, craton + m * nx, 
+               vs30 + m * nx, nx, water);
+
+#pragma omp atomic capture
+    done = ++(*ndone);
+    if (done % report == 0) {
+      fprintf(stderr,"Done with %'ld of %'ld elements\n", done * nx, total * nx);
+    }
+  }
+}
+
 int main(int ac, char **av) {
 
   /* Input files */
   char grad_path[256];
+  char dem_path[256];
   char land_path[256];
   char craton_path[256];
 
@@ -84,11 +576,19 @@ int main(int ac, char **av) {
   float water = 600;
 
   size_t nx, ny, m;
-  float *grad, *land, *craton, *vs30;
-  size_t nread, i, j, k, ndone = 0;
-  size_t nr;
-  float *tt, (*table)[4];
-  float lg, vv, tvs[2];
+  size_t ndone = 0, report;
+  size_t nthreads = 1;
+  size_t band_rows = 0, row, nrows;
+  size_t nc_chunk;
+  int nc_deflate;
+  float *grad, *land, *craton, *vs30, *dem = NULL;
+  int have_dem;
+  double earth_radius = EARTH_RADIUS;
+  struct slopeGrid S;
+  unsigned int mode;
+  int check_lut = 0;
+  char simd[16] = "auto";
+  convert_fn convertRow;
   void *API = NULL;
   struct GMT_GRID *Ggrad, *Gcrat, *Gland, *Gout;
   struct GMT_GRID_HEADER *G_hdr;
@@ -98,162 +598,215 @@ int main(int ac, char **av) {
   setlocale(LC_NUMERIC, "");
 
   setpar(ac, av);
-  mstpar("gradient_file", "s", grad_path);
+  getpar("check_lut", "b", &check_lut);
+  if (check_lut) {
+    endpar();
+    makeTables();
+    return checkLUT();
+  }
+  if ((have_dem = getpar("dem_file", "s", dem_path))) {
+    strcpy(grad_path, dem_path);
+    getpar("earth_radius", "F", &earth_radius);
+  } else {
+    mstpar("gradient_file", "s", grad_path);
+  }
   mstpar("landmask_file", "s", land_path);
   mstpar("craton_file", "s", craton_path);
   mstpar("output_file", "s", vs30_path);
   getpar("water", "f", &water);
+  getpar("threads", "z", &nthreads);
+  getStringPar("simd", simd, sizeof(simd));
+  getpar("band_rows", "z", &band_rows);
+  getNetCDFLayout(&nc_chunk, &nc_deflate);
   endpar();
 
+#ifdef _OPENMP
+  if (nthreads == 0) {
+    nthreads = omp_get_num_procs();
+  }
+#else
+  if (nthreads > 1) {
+    fprintf(stderr, "Not compiled with OpenMP, ignoring threads=%zd\n", nthreads);
+  }
+  nthreads = 1;
+#endif
+
+  makeTables();
+  convertRow = pickConvert(simd);
+
   if (stat(vs30_path, &sbuf) == 0) {
     unlink(vs30_path);
   }
 
   API = GMT_Create_Session("grad2vs30", 0, 0, NULL);
+  setNetCDFLayout(API, nc_chunk, nc_deflate);
 
-  /* Initialize the input objects and open the files */
-  fprintf(stderr, "Reading input files...");
-  if ((Ggrad = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
-				  GMT_IS_FILE, GMT_IS_SURFACE,
-				  GMT_CONTAINER_AND_DATA, NULL,
-				  grad_path, NULL)) == NULL) {
-    fprintf(stderr, "Couldn't read %s\n", grad_path);
-    exit(-1);
-  }
-  if ((Gland = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
-				  GMT_IS_FILE, GMT_IS_SURFACE,
-				  GMT_CONTAINER_AND_DATA, NULL,
-				  land_path, NULL)) == NULL) {
-    fprintf(stderr, "Couldn't read %s\n", land_path);
-    exit(-1);
-  }
-  if ((Gcrat = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
-				  GMT_IS_FILE, GMT_IS_SURFACE,
-				  GMT_CONTAINER_AND_DATA, NULL,
-				  craton_path, NULL)) == NULL) {
-    fprintf(stderr, "Couldn't read %s\n", craton_path);
-    exit(-1);
+  /*
+   * Initialize the input objects and open the files; in band mode
+   * only the headers are read here and the data come in a band of
+   * rows at a time
+   */
+  if (band_rows == 0) {
+    fprintf(stderr, "Reading input files...");
+    mode = GMT_CONTAINER_AND_DATA;
+  } else {
+    fprintf(stderr, "Opening input files...");
+    mode = GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW;
   }
+  /* With dem_file, Ggrad is the DEM (grad_path is its name) */
+  Ggrad = openGrid(API, grad_path, mode);
+  Gland = openGrid(API, land_path, mode);
+  Gcrat = openGrid(API, craton_path, mode);
   fprintf(stderr, "Done.\n");
 
   G_hdr = Ggrad->header;
   nx = G_hdr->n_columns;
   ny = G_hdr->n_rows;
 
+  if (Gland->header->n_columns != nx || Gland->header->n_rows != ny ||
+      Gcrat->header->n_columns != nx || Gcrat->header->n_rows != ny) {
+    fprintf(stderr, "Input grids must all be the same size\n");
+    exit(-1);
+  }
+
+  if (have_dem) {
+    if (nx < 2 || ny < 2) {
+      fprintf(stderr, "%s is too small to take the slope of\n", dem_path);
+      exit(-1);
+    }
+    S.nx = nx;
+    S.ny = ny;
+    S.wrap = WRAP_NONE;
+    if (fabs(G_hdr->wesn[GMT_XHI] - G_hdr->wesn[GMT_XLO] - 360) <
+        0.5 * G_hdr->inc[GMT_X]) {
+      S.wrap = G_hdr->registration ? WRAP_PIXEL : WRAP_GRIDLINE;
+    }
+    S.lat0 = G_hdr->wesn[GMT_YHI] -
+             (G_hdr->registration ? 0.5 * G_hdr->inc[GMT_Y] : 0);
+    S.dlat = G_hdr->inc[GMT_Y];
+    S.mx = 2 * M_PI * earth_radius / 360 * G_hdr->inc[GMT_X];
+    S.my = 2 * M_PI * earth_radius / 360 * G_hdr->inc[GMT_Y];
+  }
+
   /*
    * The output file has the same dimensions as Ggrad
    * so write the header, prep the output object, then open
    * the output for writing.
    */
   if ((Gout = GMT_Create_Data(API, GMT_IS_GRID, GMT_IS_SURFACE,
-                  GMT_CONTAINER_AND_DATA, NULL,
-                  Ggrad->header->wesn, Ggrad->header->inc,
+                  band_rows == 0 ? GMT_CONTAINER_AND_DATA : GMT_CONTAINER_ONLY, 
+                  NULL, Ggrad->header->wesn, Ggrad->header->inc,
                   GMT_GRID_NODE_REG, 0, NULL)) == NULL) {
     fprintf(stderr, "Couldn't create %s\n", vs30_path);
     exit(-1);
   }
 
-  /* 
-   * We're doing log-log interpolation, so log() everything in the 
-   * tables first, for efficiency 
-   */
-  for (i = 0; i < rows_active; i++) {
-    active_table[i][0] = log(active_table[i][0]);
-    active_table[i][1] = log(active_table[i][1]);
-    active_table[i][2] = log(active_table[i][2]);
-    active_table[i][3] = log(active_table[i][3]);
-  }
-  for (i = 0; i < rows_craton; i++) {
-    craton_table[i][0] = log(craton_table[i][0]);
-    craton_table[i][1] = log(craton_table[i][1]);
-    craton_table[i][2] = log(craton_table[i][2]);
-    craton_table[i][3] = log(craton_table[i][3]);
-  }
+  report = ny / 100 > 0 ? ny / 100 : 1;
+
+  /* The conversion (and the water value) bound the range of the output */
+  checkOutputRange(vs30_path, water < vs30_min ? water : vs30_min,
+                   water > vs30_max ? water : vs30_max);
 
-  for (m = 0; m < ny; m++) {
-    grad = Ggrad->data + m * nx;
-    land = Gland->data + m * nx;
-    craton = Gcrat->data + m * nx;
-	vs30 = Gout->data + m * nx;
-
-    for (i = 0; i < nx; i++) {
-      /* Set areas covered by water to the water value */
-      if (land[i] == 0) {
-        vs30[i] = water;
-        continue;
+  if (band_rows == 0) {
+    grad = Ggrad->data;
+    if (have_dem) {
+      fprintf(stderr, "Computing the slope...");
+      if ((grad = (float *)malloc(nx * ny * sizeof(float))) == NULL) {
+        fprintf(stderr, "No memory for the slope\n");
+        exit(-1);
       }
+      slopeBand(&S, Ggrad->data, 0, ny, grad, nthreads);
+      fprintf(stderr, "Done.\n");
+    }
+    convertBand(convertRow, grad, Gland->data, Gcrat->data, 
+                Gout->data, ny, nx, water, nthreads, &ndone, ny, report);
+    if (have_dem) {
+      free(grad);
+    }
 
-      /* This is the slope value to be converted to vs30 */
-      lg = log(grad[i]);
+    fprintf(stderr, "Writing output file...");
+    if (GMT_Write_Data(API, GMT_IS_GRID,
+                GMT_IS_FILE, GMT_IS_SURFACE,
+                GMT_CONTAINER_AND_DATA, NULL,
+                vs30_path, Gout) != 0) {
+      fprintf(stderr, "Couldn't write %s\n", vs30_path);
+      exit(-1);
+    }
+    fprintf(stderr, "Done.\n");
+  } else {
+    /*
+     * Band mode: only band_rows rows of each of the three inputs
+     * and the output are ever in memory. We can't know the range of 
+     * the output before the header is written, so put in the range 
+     * that the conversion (and the water value) can produce.
+     */
+    if (band_rows > ny) {
+      band_rows = ny;
+    }
+    if ((grad = (float *)malloc(4 * band_rows * nx * sizeof(float))) == NULL) {
+      fprintf(stderr, "No memory for %zd row bands\n", band_rows);
+      exit(-1);
+    }
+    land = grad + band_rows * nx;
+    craton = land + band_rows * nx;
+    vs30 = craton + band_rows * nx;
 
-      /* Get the Vs30 for both craton and active */
-      for (k = 0; k < 2; k++) {
+    /*
+     * The DEM comes in a band at a time too, with the rows on either
+     * side of the band: row (row - 1 + p) of the DEM is row p of dem
+     */
+    if (have_dem &&
+        (dem = (float *)malloc((band_rows + 2) * nx * sizeof(float))) == NULL) {
+      fprintf(stderr, "No memory for %zd row bands\n", band_rows);
+      exit(-1);
+    }
 
-        /* k == 0 => craton, k == 1 => active */
-        if (k == 0) {
-          table = craton_table;
-          nr = rows_craton;
-        } else {
-          table = active_table;
-          nr = rows_active;
-        }
+    Gout->header->z_min = water < vs30_min ? water : vs30_min;
+    Gout->header->z_max = water > vs30_max ? water : vs30_max;
+    if (GMT_Write_Data(API, GMT_IS_GRID,
+                GMT_IS_FILE, GMT_IS_SURFACE,
+                GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW, NULL,
+                vs30_path, Gout) != 0) {
+      fprintf(stderr, "Couldn't open %s for writing\n", vs30_path);
+      exit(-1);
+    }
 
-        /* 
-         * Handle slopes lower than the minimum in the table by
-         * extrapolation capped by the minimum vs30 (this isn't
-         * necessary when the table contains the minimum vs30,
-         * but it's cheap insurance if we change the table or
-         * minimum -- ditto for the max, below)
-         */
-        if (lg <= table[0][2]) {
-          tt = table[0];
-          vv = interpVs30(tt,lg);
-          if (vv < vs30_min) {
-            vv = vs30_min;
-          }
-          tvs[k] = vv;
-          continue;
+    for (row = 0; row < ny; row += nrows) {
+      nrows = ny - row < band_rows ? ny - row : band_rows;
+      for (m = 0; m < nrows; m++) {
+        if ((!have_dem && GMT_Get_Row(API, row + m, Ggrad, grad + m * nx)) ||
+            GMT_Get_Row(API, row + m, Gland, land + m * nx) ||
+            GMT_Get_Row(API, row + m, Gcrat, craton + m * nx)) {
+          fprintf(stderr, "Couldn't read row %zd of the input\n", row + m);
+          exit(-1);
         }
-        /* 
-         * Handle slopes greater than the maximum in the table by 
-         * extrapolation capped by the maximum vs30 
-         */
-        if (lg >= table[nr-1][3]) {
-          tt = table[nr-1];
-          vv = interpVs30(tt,lg);
-          if (vv > vs30_max) {
-            vv = vs30_max;
-          }
-          tvs[k] = vv;
-          continue;
+      }
+      if (have_dem) {
+        /* The last band read this band's first row and the one above */
+        if (row > 0) {
+          memmove(dem, dem + band_rows * nx, 2 * nx * sizeof(float));
         }
-        /* All other slopes should be handled within the tables */
-        for (j = 0; j < nr; j++) {
-          if (lg <= table[j][3]) {
-            tt = table[j];
-            tvs[k] = interpVs30(tt,lg);
-            break;
+        for (m = row == 0 ? 0 : row + 1; m <= row + nrows && m < ny; m++) {
+          if (GMT_Get_Row(API, m, Ggrad, dem + (m + 1 - row) * nx)) {
+            fprintf(stderr, "Couldn't read row %zd of %s\n", m, dem_path);
+            exit(-1);
           }
         }
+        slopeBand(&S, dem + nx, row, nrows, grad, nthreads);
+      }
+      convertBand(convertRow, grad, land, craton, vs30, 
+                  nrows, nx, water, nthreads, &ndone, ny, report);
+      for (m = 0; m < nrows; m++) {
+        if (GMT_Put_Row(API, row + m, Gout, vs30 + m * nx)) {
+          fprintf(stderr, "Couldn't write row %zd of %s\n", row + m, vs30_path);
+          exit(-1);
+        }
       }
-      /* Do a weighted average of craton and active vs30 */
-      vs30[i] = craton[i] * tvs[0] + (1.0 - craton[i]) * tvs[1];
-    }
-    if(++ndone % 100 == 0) {
-      fprintf(stderr,"Done with %'ld of %'ld elements\n", ndone * nx, ny * nx);
     }
+    free(grad);
+    free(dem);
   }
 
-  fprintf(stderr, "Writing output file...");
-  if (GMT_Write_Data(API, GMT_IS_GRID,
-              GMT_IS_FILE, GMT_IS_SURFACE,
-              GMT_CONTAINER_AND_DATA, NULL,
-              vs30_path, Gout) != 0) {
-    fprintf(stderr, "Couldn't write %s\n", vs30_path);
-    exit(-1);
-  }
-  fprintf(stderr, "Done.\n");
-
   GMT_End_IO(API, GMT_IN, 0);
   GMT_End_IO(API, GMT_OUT, 0);
   GMT_Destroy_Session(API);
@@ -0,0 +1,786 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <locale.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <gmt.h>
+
+#include "libget.h"
+#include "grdutil.h"
+#include "ncformat.h"
+
+/*
+ * grdcalc: evaluate a grdmath-style expression over grids
+ *
+ * "expr" (required) is a reverse Polish expression in the style of
+ * grdmath: a list of operands and operators separated by spaces,
+ * where every token that is a number is a constant, every token
+ * that is one of the operators below is that operator, and every
+ * other token is the name of a grid file. All of the grids must be
+ * point for point co-registered with each other; the output (named
+ * with "outfile", required) has their dimensions.
+ *
+ * The operators (a subset of grdmath's, with the same meanings) are:
+ *
+ *   A B ADD       A + B
+ *   A B SUB       A - B
+ *   A B MUL       A * B
+ *   A B DIV       A / B
+ *   A B POW       A ^ B
+ *   A LOG         ln(A)
+ *   A EXP         e ^ A
+ *   A B GT        1 if A > B, else 0 (NaN if A or B is NaN)
+ *   A B GE        1 if A >= B, else 0 (ditto)
+ *   A B LT        1 if A < B, else 0 (ditto)
+ *   A B LE        1 if A <= B, else 0 (ditto)
+ *   A B EQ        1 if A == B, else 0 (ditto)
+ *   A B NEQ       1 if A != B, else 0 (ditto)
+ *   A NOT         1 if A == 0, else 0 (NaN if A is NaN)
+ *   A B C IFELSE  B if A is not 0, else C
+ *   A B AND       B if A is NaN, else A
+ *   A B DENAN     B if A is NaN, else A
+ *   A B NAN       NaN if A == B, else A
+ *   A DUP         A A
+ *   A B EXCH      B A
+ *
+ * As in grdmath, each operator is computed in double precision and
+ * the result rounded to float, so a chain of grdmath commands and
+ * the same operators in one expression give identical grids; the
+ * parts of the expression that involve only constants are worked
+ * out (in double precision) before the grids are read.
+ *
+ * The grids are read, and the output written, a band of rows at a
+ * time, so each is read and written just once and the memory used
+ * is about 4 * band_rows * (number of columns) * (number of grids +
+ * depth of the stack) bytes. The optional "band_rows" sets the size
+ * of the bands (default 1000; 0 reads the whole grids into memory).
+ * The rows of each band are split across "threads" worker threads
+ * (default 1; 0 means one per processor); the output is the same no
+ * matter how many are used. "chunk" and "deflate" set the tiling
+ * and compression of a netCDF outfile (see ncformat.c).
+ *
+ * With check=1 grdcalc just evaluates a set of test expressions
+ * (check_exprs, below) on a row of test values and compares each
+ * point with the same expression worked out a point at a time;
+ * it exits with a non-zero status if any of them differ.
+ */
+
+#define MAX_TOKENS 512
+
+enum opcode {
+  OP_GRID, OP_CONST,
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW, OP_LOG, OP_EXP,
+  OP_GT, OP_GE, OP_LT, OP_LE, OP_EQ, OP_NEQ, OP_NOT,
+  OP_IFELSE, OP_AND, OP_DENAN, OP_NAN, OP_DUP, OP_EXCH
+};
+
+struct opinfo {
+  const char *name;
+  enum opcode op;
+  int nin, nout;
+};
+
+const struct opinfo operators[] = {
+  { "ADD",    OP_ADD,    2, 1 },
+  { "SUB",    OP_SUB,    2, 1 },
+  { "MUL",    OP_MUL,    2, 1 },
+  { "DIV",    OP_DIV,    2, 1 },
+  { "POW",    OP_POW,    2, 1 },
+  { "LOG",    OP_LOG,    1, 1 },
+  { "EXP",    OP_EXP,    1, 1 },
+  { "GT",     OP_GT,     2, 1 },
+  { "GE",     OP_GE,     2, 1 },
+  { "LT",     OP_LT,     2, 1 },
+  { "LE",     OP_LE,     2, 1 },
+  { "EQ",     OP_EQ,     2, 1 },
+  { "NEQ",    OP_NEQ,    2, 1 },
+  { "NOT",    OP_NOT,    1, 1 },
+  { "IFELSE", OP_IFELSE, 3, 1 },
+  { "AND",    OP_AND,    2, 1 },
+  { "DENAN",  OP_DENAN,  2, 1 },
+  { "NAN",    OP_NAN,    2, 1 },
+  { "DUP",    OP_DUP,    1, 2 },
+  { "EXCH",   OP_EXCH,   2, 2 },
+  { NULL,     OP_GRID,   0, 0 }
+};
+
+/*
+ * An instruction of the compiled expression: push grid "grid", push
+ * the constant "value", or apply an operator to the top of the stack
+ */
+struct instr {
+  enum opcode op;
+  int nin;
+  size_t grid;
+  double value;
+};
+
+struct program {
+  struct instr code[MAX_TOKENS];
+  size_t ncode;
+  size_t depth;                 /* the most entries ever on the stack */
+  char *grids[MAX_TOKENS];      /* the distinct grid files */
+  size_t ngrids;
+};
+
+/*
+ * A stack entry while the expression is evaluated: either a
+ * constant or a row of nx values
+ */
+struct operand {
+  int is_const;
+  double value;
+  const float *row;
+};
+
+/*
+ * Function applyScalar applies a (non-stack) operator to constants;
+ * it is used to fold the constant parts of the expression, and its
+ * results must match those of applyRow
+ */
+double applyScalar(enum opcode op, double a, double b, double c) {
+  switch (op) {
+    case OP_ADD:    return a + b;
+    case OP_SUB:    return a - b;
+    case OP_MUL:    return a * b;
+    case OP_DIV:    return a / b;
+    case OP_POW:    return pow(a, b);
+    case OP_LOG:    return log(a);
+    case OP_EXP:    return exp(a);
+    case OP_GT:     return (isnan(a) || isnan(b)) ? NAN : (a > b);
+    case OP_GE:     return (isnan(a) || isnan(b)) ? NAN : (a >= b);
+    case OP_LT:     return (isnan(a) || isnan(b)) ? NAN : (a < b);
+    case OP_LE:     return (isnan(a) || isnan(b)) ? NAN : (a <= b);
+    case OP_EQ:     return (isnan(a) || isnan(b)) ? NAN : (a == b);
+    case OP_NEQ:    return (isnan(a) || isnan(b)) ? NAN : (a != b);
+    case OP_NOT:    return isnan(a) ? NAN : (a == 0);
+    case OP_IFELSE: return a != 0 ? b : c;
+    case OP_AND:
+    case OP_DENAN:  return isnan(a) ? b : a;
+    case OP_NAN:    return a == b ? NAN : a;
+    default:        return NAN;
+  }
+}
+
+/*
+ * Function compile turns the expression into a program, checking
+ * that every operator has enough operands and that exactly one
+ * value is left at the end; operators whose operands are all
+ * constants are evaluated here. Exits with a message on error.
+ */
+void compile(char *expr, struct program *P) {
+  char *tok, *end;
+  const struct opinfo *oi;
+  struct instr *in;
+  size_t depth = 0, k;
+  double v[3];
+  int i, nconst;
+
+  memset(P, 0, sizeof(*P));
+  for (tok = strtok(expr, " \t\n"); tok != NULL; tok = strtok(NULL, " \t\n")) {
+    if (P->ncode == MAX_TOKENS) {
+      fprintf(stderr, "Expression is too long (more than %d tokens)\n", MAX_TOKENS);
+      exit(-1);
+    }
+    in = P->code + P->ncode;
+    for (oi = operators; oi->name != NULL; oi++) {
+      if (strcmp(tok, oi->name) == 0) {
+        break;
+      }
+    }
+    if (oi->name == NULL) {
+      /* An operand: a constant if it's a number, otherwise a grid */
+      in->value = strtod(tok, &end);
+      if (*end == '\0') {
+        in->op = OP_CONST;
+      } else {
+        in->op = OP_GRID;
+        for (k = 0; k < P->ngrids; k++) {
+          if (strcmp(P->grids[k], tok) == 0) {
+            break;
+          }
+        }
+        if (k == P->ngrids) {
+          P->grids[P->ngrids++] = tok;
+        }
+        in->grid = k;
+      }
+      P->ncode++;
+      if (++depth > P->depth) {
+        P->depth = depth;
+      }
+      continue;
+    }
+
+    if (depth < (size_t)oi->nin) {
+      fprintf(stderr, "%s needs %d operands, but the stack has %zd\n",
+              oi->name, oi->nin, depth);
+      exit(-1);
+    }
+    depth += oi->nout - oi->nin;
+    if (depth > P->depth) {
+      P->depth = depth;
+    }
+
+    /* Fold the operator if its operands are the constants just pushed */
+    nconst = 0;
+    for (i = 1; i <= oi->nin && (size_t)i <= P->ncode; i++) {
+      if (in[-i].op != OP_CONST) {
+        break;
+      }
+      nconst++;
+    }
+    if (nconst == oi->nin) {
+      for (i = 0; i < oi->nin; i++) {
+        v[i] = in[i - oi->nin].value;
+      }
+      if (oi->op == OP_DUP) {
+        in->op = OP_CONST;
+        in->value = v[0];
+        P->ncode++;
+      } else if (oi->op == OP_EXCH) {
+        in[-2].value = v[1];
+        in[-1].value = v[0];
+      } else {
+        P->ncode -= oi->nin;
+        in = P->code + P->ncode;
+        in->op = OP_CONST;
+        in->value = applyScalar(oi->op, v[0],
+                                oi->nin > 1 ? v[1] : 0, oi->nin > 2 ? v[2] : 0);
+        P->ncode++;
+      }
+      continue;
+    }
+    in->op = oi->op;
+    in->nin = oi->nin;
+    P->ncode++;
+  }
+
+  if (depth != 1) {
+    fprintf(stderr, "Expression leaves %zd values on the stack; it must leave 1\n",
+            depth);
+    exit(-1);
+  }
+  if (P->ngrids == 0) {
+    fprintf(stderr, "Expression has no grids in it\n");
+    exit(-1);
+  }
+}
+
+/*
+ * The loops for the binary operators: one for each combination of
+ * a constant and a row operand (evalRow works out the operations on
+ * constants alone), each simple enough for the compiler to vectorize
+ */
+#define BINARY(expr)                                                    \
+  if (A->is_const) {                                                    \
+    const double a = A->value;                                          \
+    for (i = 0; i < nx; i++) { const double b = pb[i]; out[i] = (expr); } \
+  } else if (B->is_const) {                                             \
+    const double b = B->value;                                          \
+    for (i = 0; i < nx; i++) { const double a = pa[i]; out[i] = (expr); } \
+  } else {                                                              \
+    for (i = 0; i < nx; i++) {                                          \
+      const double a = pa[i], b = pb[i]; out[i] = (expr);               \
+    }                                                                   \
+  }
+
+#define COMPARE(cmp) \
+  BINARY((isnan(a) || isnan(b)) ? NAN : (float)(cmp))
+
+/*
+ * Function applyRow applies the operator op to the nin operands
+ * starting at A, putting the result (nx values) in out, which may
+ * be one of the operand rows
+ */
+void applyRow(enum opcode op, struct operand *A, float *out, size_t nx) {
+  const struct operand *B = A + 1, *C = A + 2;
+  const float *pa = A->row, *pb = B->row;
+  size_t i;
+
+  switch (op) {
+    case OP_ADD:   BINARY(a + b);      break;
+    case OP_SUB:   BINARY(a - b);      break;
+    case OP_MUL:   BINARY(a * b);      break;
+    case OP_DIV:   BINARY(a / b);      break;
+    case OP_POW:   BINARY(pow(a, b));  break;
+    case OP_GT:    COMPARE(a > b);     break;
+    case OP_GE:    COMPARE(a >= b);    break;
+    case OP_LT:    COMPARE(a < b);     break;
+    case OP_LE:    COMPARE(a <= b);    break;
+    case OP_EQ:    COMPARE(a == b);    break;
+    case OP_NEQ:   COMPARE(a != b);    break;
+    case OP_AND:
+    case OP_DENAN: BINARY(isnan(a) ? b : a);     break;
+    case OP_NAN:   BINARY(a == b ? NAN : a);     break;
+    case OP_LOG:
+      for (i = 0; i < nx; i++) out[i] = log((double)pa[i]);
+      break;
+    case OP_EXP:
+      for (i = 0; i < nx; i++) out[i] = exp((double)pa[i]);
+      break;
+    case OP_NOT:
+      for (i = 0; i < nx; i++) out[i] = isnan(pa[i]) ? NAN : (pa[i] == 0);
+      break;
+    case OP_IFELSE:
+      for (i = 0; i < nx; i++) {
+        double a = A->is_const ? A->value : pa[i];
+        double b = B->is_const ? B->value : B->row[i];
+        double c = C->is_const ? C->value : C->row[i];
+        out[i] = a != 0 ? b : c;
+      }
+      break;
+    default:
+      break;
+  }
+  A->is_const = 0;
+  A->row = out;
+}
+
+/*
+ * Function evalRow evaluates the program for one row of nx points;
+ * in[k] is the row of the k-th grid, and buf has room for "depth"
+ * rows; the first stack entry is computed in the output row if it can
+ */
+void evalRow(const struct program *P, const float **in, float *out,
+             float *buf, struct operand *stack, size_t nx) {
+  const struct instr *ip;
+  struct operand *top = stack - 1, tmp;
+  size_t n, b, j, i;
+  float *dst = out;
+
+  for (ip = P->code; ip < P->code + P->ncode; ip++) {
+    switch (ip->op) {
+      case OP_GRID:
+        top++;
+        top->is_const = 0;
+        top->row = in[ip->grid];
+        break;
+      case OP_CONST:
+        top++;
+        top->is_const = 1;
+        top->value = ip->value;
+        break;
+      case OP_DUP:
+        top[1] = top[0];
+        top++;
+        break;
+      case OP_EXCH:
+        tmp = top[0];
+        top[0] = top[-1];
+        top[-1] = tmp;
+        break;
+      default:
+        /*
+         * The result goes in the row of the stack entry it replaces
+         * unless, after a DUP or an EXCH, an entry below still needs
+         * that row; then it goes in the next free one
+         */
+        top -= ip->nin - 1;
+
+        /*
+         * Constants moved under a grid by a DUP or an EXCH reach here
+         * unfolded; an operator on nothing but constants gives one
+         */
+        for (j = 0; j < (size_t)ip->nin && top[j].is_const; j++)
+          ;
+        if (j == (size_t)ip->nin) {
+          top->value = applyScalar(ip->op, top[0].value,
+                                   ip->nin > 1 ? top[1].value : 0,
+                                   ip->nin > 2 ? top[2].value : 0);
+          break;
+        }
+        n = top - stack;
+        for (b = n; b <= P->depth + n; b++) {
+          dst = b % (P->depth + 1) == 0 ? out : buf + (b % (P->depth + 1) - 1) * nx;
+          for (j = 0; j < n; j++) {
+            if (!stack[j].is_const && stack[j].row == dst) {
+              break;
+            }
+          }
+          if (j == n) {
+            break;
+          }
+        }
+        applyRow(ip->op, top, dst, nx);
+        break;
+    }
+  }
+
+  /* The expression may have been a single grid or constant */
+  if (stack->is_const) {
+    for (i = 0; i < nx; i++) out[i] = stack->value;
+  } else if (stack->row != out) {
+    memcpy(out, stack->row, nx * sizeof(float));
+  }
+}
+
+/*
+ * The expressions for check=1, in the one grid "A"; the last ones
+ * have constants that a DUP or an EXCH moves under the grid, which
+ * compile can't fold
+ */
+const char *check_exprs[] = {
+  "A 2 ADD", "2 A SUB", "A A MUL 3 DIV", "A LOG", "A EXP", "2 A POW",
+  "A 0 GT", "A 1 LE", "A A EQ", "A NOT", "A 1 A IFELSE", "A 5 AND",
+  "A 0 NAN", "A 7 DENAN", "A DUP ADD", "A 2 EXCH SUB", "2 DUP MUL A ADD",
+  "2 A EXCH 3 ADD ADD", "2 A EXCH NOT ADD", "2 A EXCH LOG ADD",
+  "3 A EXCH DUP MUL ADD", "2 A EXCH 3 EXCH IFELSE",
+  "1 A EXCH 2 3 IFELSE ADD", "0 A EXCH 4 DENAN MUL",
+  NULL
+};
+
+/*
+ * Function evalScalar evaluates the program for a single point, where
+ * the grids have the values "grid", rounding each result that isn't
+ * a constant to float, as evalRow does
+ */
+double evalScalar(const struct program *P, const double *grid) {
+  struct {
+    int is_const;
+    double value;
+  } stack[MAX_TOKENS], *top = stack - 1, tmp;
+  const struct instr *ip;
+  int j, is_const;
+
+  for (ip = P->code; ip < P->code + P->ncode; ip++) {
+    switch (ip->op) {
+      case OP_GRID:
+        top++;
+        top->is_const = 0;
+        top->value = grid[ip->grid];
+        break;
+      case OP_CONST:
+        top++;
+        top->is_const = 1;
+        top->value = ip->value;
+        break;
+      case OP_DUP:
+        top[1] = top[0];
+        top++;
+        break;
+      case OP_EXCH:
+        tmp = top[0];
+        top[0] = top[-1];
+        top[-1] = tmp;
+        break;
+      default:
+        top -= ip->nin - 1;
+        is_const = 1;
+        for (j = 0; j < ip->nin; j++) {
+          is_const = is_const && top[j].is_const;
+        }
+        top->value = applyScalar(ip->op, top[0].value,
+                                 ip->nin > 1 ? top[1].value : 0,
+                                 ip->nin > 2 ? top[2].value : 0);
+        if (!(top->is_const = is_const)) {
+          top->value = (float)top->value;
+        }
+        break;
+    }
+  }
+  return stack->is_const ? (float)stack->value : stack->value;
+}
+
+/*
+ * Function checkExpressions evaluates each of check_exprs on a row
+ * of test values (including 0, negative numbers, and NaN) and
+ * compares the results with evalScalar's; returns non-zero if any
+ * of them differ
+ */
+int checkExpressions(void) {
+  const float vals[] = { 0, 1, -1, 2.5, -0.5, 7, 1e-3, 1234.5, NAN };
+  const size_t nx = sizeof(vals) / sizeof(vals[0]);
+  const float *in[1] = { vals };
+  char expr[256];
+  struct program P;
+  struct operand *stack;
+  float out[sizeof(vals) / sizeof(vals[0])], *buf;
+  double a, ref;
+  size_t e, i;
+  int bad = 0;
+
+  for (e = 0; check_exprs[e] != NULL; e++) {
+    snprintf(expr, sizeof(expr), "%s", check_exprs[e]);
+    compile(expr, &P);
+    if ((stack = (struct operand *)malloc(P.depth * sizeof(*stack))) == NULL ||
+        (buf = (float *)malloc(P.depth * nx * sizeof(float))) == NULL) {
+      fprintf(stderr, "No memory for the stack\n");
+      exit(-1);
+    }
+    evalRow(&P, in, out, buf, stack, nx);
+    for (i = 0; i < nx; i++) {
+      a = vals[i];
+      ref = evalScalar(&P, &a);
+      if (!(out[i] == (float)ref || (isnan(out[i]) && isnan(ref)))) {
+        fprintf(stderr, "\"%s\" with A = %g: got %.9g, expected %.9g\n",
+                check_exprs[e], vals[i], out[i], ref);
+        bad = 1;
+      }
+    }
+    free(buf);
+    free(stack);
+  }
+  fprintf(stderr, "Checked %zd expressions: %s\n", e, bad ? "FAILED" : "OK");
+  return bad;
+}
+
+/*
+ * Function evalBand evaluates the program for nrows rows of nx points;
+ * in[k] is the first row of the band of the k-th grid. The rows are
+ * split across the threads, each with its own stack; the workers
+ * share a single count of finished rows (ndone, out of total) so
+ * progress is reported for the grid as a whole every "report" rows.
+ * The range of the output is accumulated in z_min and z_max.
+ */
+void evalBand(const struct program *P, float **in, float *out,
+              size_t nrows, size_t nx, size_t nthreads, size_t *ndone,
+              size_t total, size_t report, double *z_min, double *z_max) {
+
+#pragma omp parallel num_threads(nthreads)
+  {
+    const float *rows[MAX_TOKENS];
+    struct operand *stack;
+    float *buf, zlo = INFINITY, zhi = -INFINITY;
+    size_t m, k, i, done;
+
+    if ((stack = (struct operand *)malloc(P->depth * sizeof(*stack))) == NULL ||
+        (buf = (float *)malloc(P->depth * nx * sizeof(float))) == NULL) {
+      fprintf(stderr, "No memory for the stack\n");
+      exit(-1);
+    }
+
+#pragma omp for schedule(dynamic, 16)
+    for (m = 0; m < nrows; m++) {
+      for (k = 0; k < P->ngrids; k++) {
+        rows[k] = in[k] + m * nx;
+      }
+      evalRow(P, rows, out + m * nx, buf, stack, nx);
+      for (i = 0; i < nx; i++) {
+        if (out[m * nx + i] < zlo) zlo = out[m * nx + i];
+        if (out[m * nx + i] > zhi) zhi = out[m * nx + i];
+      }
+
+#pragma omp atomic capture
+      done = ++(*ndone);
+      if (done % report == 0) {
+        fprintf(stderr,"Done with %'ld of %'ld elements\n", done * nx, total * nx);
+      }
+    }
+
+#pragma omp critical(range)
+    {
+      if (zlo < *z_min) *z_min = zlo;
+      if (zhi > *z_max) *z_max = zhi;
+    }
+    free(buf);
+    free(stack);
+  }
+}
+
+int main(int ac, char **av) {
+
+  char expr[5120];
+  char out_path[256];
+
+  size_t nx, ny, k, m;
+  size_t ndone = 0, report;
+  size_t nthreads = 1, nc_chunk;
+  int nc_deflate;
+  size_t band_rows = 1000, row, nrows;
+  double z_min = INFINITY, z_max = -INFINITY;
+  unsigned int mode;
+  int check = 0;
+  float *in[MAX_TOKENS], *out;
+  struct program P;
+  void *API = NULL;
+  struct GMT_GRID *Gin[MAX_TOKENS], *Gout;
+  struct GMT_GRID_HEADER *G_hdr;
+  struct stat sbuf;
+
+  setlocale(LC_NUMERIC, "");
+
+  setpar(ac, av);
+  getpar("check", "b", &check);
+  if (check) {
+    endpar();
+    return checkExpressions();
+  }
+  mstpar("expr", "s", expr);
+  mstpar("outfile", "s", out_path);
+  getpar("band_rows", "z", &band_rows);
+  getpar("threads", "z", &nthreads);
+  getNetCDFLayout(&nc_chunk, &nc_deflate);
+  endpar();
+
+#ifdef _OPENMP
+  if (nthreads == 0) {
+    nthreads = omp_get_num_procs();
+  }
+#else
+  if (nthreads > 1) {
+    fprintf(stderr, "Not compiled with OpenMP, ignoring threads=%zd\n", nthreads);
+  }
+  nthreads = 1;
+#endif
+
+  compile(expr, &P);
+
+  if (stat(nativeFileName(out_path), &sbuf) == 0) {
+    unlink(nativeFileName(out_path));
+  }
+
+  API = GMT_Create_Session("grdcalc", 0, 0, NULL);
+  setNetCDFLayout(API, nc_chunk, nc_deflate);
+
+  /*
+   * Open the grids; in band mode only the headers are read here
+   */
+  if (band_rows == 0) {
+    fprintf(stderr, "Reading input files...");
+    mode = GMT_CONTAINER_AND_DATA;
+  } else {
+    fprintf(stderr, "Opening input files...");
+    mode = GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW;
+  }
+  for (k = 0; k < P.ngrids; k++) {
+    if ((Gin[k] = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                    GMT_IS_FILE, GMT_IS_SURFACE,
+                    mode, NULL, P.grids[k], NULL)) == NULL) {
+      fprintf(stderr, "Couldn't read %s\n", P.grids[k]);
+      exit(-1);
+    }
+  }
+  fprintf(stderr, "Done.\n");
+
+  G_hdr = Gin[0]->header;
+  nx = G_hdr->n_columns;
+  ny = G_hdr->n_rows;
+  for (k = 1; k < P.ngrids; k++) {
+    if (Gin[k]->header->n_columns != nx || Gin[k]->header->n_rows != ny) {
+      fprintf(stderr, "%s is not the same size as %s\n", P.grids[k], P.grids[0]);
+      exit(-1);
+    }
+  }
+
+  if ((Gout = GMT_Create_Data(API, GMT_IS_GRID, GMT_IS_SURFACE,
+                  band_rows == 0 ? GMT_CONTAINER_AND_DATA : GMT_CONTAINER_ONLY,
+                  NULL, G_hdr->wesn, G_hdr->inc,
+                  G_hdr->registration, 0, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't create %s\n", out_path);
+    exit(-1);
+  }
+
+  report = ny / 100 > 0 ? ny / 100 : 1;
+
+  if (band_rows == 0) {
+    for (k = 0; k < P.ngrids; k++) {
+      in[k] = Gin[k]->data;
+    }
+    evalBand(&P, in, Gout->data, ny, nx, nthreads, &ndone, ny, report,
+             &z_min, &z_max);
+
+    checkOutputRange(out_path, z_min, z_max);
+    fprintf(stderr, "Writing output file...");
+    if (GMT_Write_Data(API, GMT_IS_GRID,
+                GMT_IS_FILE, GMT_IS_SURFACE,
+                GMT_CONTAINER_AND_DATA, NULL,
+                out_path, Gout) != 0) {
+      fprintf(stderr, "Couldn't write %s\n", out_path);
+      exit(-1);
+    }
+    fprintf(stderr, "Done.\n");
+  } else {
+    /*
+     * Band mode: only band_rows rows of each grid and of the output
+     * are ever in memory. The header goes out before any of the
+     * data, so the range in it is unknown (NaN) at that point; it is
+     * filled in once the rows are done.
+     */
+    if (band_rows > ny) {
+      band_rows = ny;
+    }
+    for (k = 0; k <= P.ngrids; k++) {
+      if ((in[k] = (float *)malloc(band_rows * nx * sizeof(float))) == NULL) {
+        fprintf(stderr, "No memory for %zd row bands\n", band_rows);
+        exit(-1);
+      }
+    }
+    out = in[P.ngrids];
+
+    Gout->header->z_min = NAN;
+    Gout->header->z_max = NAN;
+    if (GMT_Write_Data(API, GMT_IS_GRID,
+                GMT_IS_FILE, GMT_IS_SURFACE,
+                GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW, NULL,
+                out_path, Gout) != 0) {
+      fprintf(stderr, "Couldn't open %s for writing\n", out_path);
+      exit(-1);
+    }
+
+    for (row = 0; row < ny; row += nrows) {
+      nrows = ny - row < band_rows ? ny - row : band_rows;
+      for (k = 0; k < P.ngrids; k++) {
+        for (m = 0; m < nrows; m++) {
+          if (GMT_Get_Row(API, row + m, Gin[k], in[k] + m * nx)) {
+            fprintf(stderr, "Couldn't read row %zd of %s\n", row + m, P.grids[k]);
+            exit(-1);
+          }
+        }
+      }
+      evalBand(&P, in, out, nrows, nx, nthreads, &ndone, ny, report,
+               &z_min, &z_max);
+      for (m = 0; m < nrows; m++) {
+        if (GMT_Put_Row(API, row + m, Gout, out + m * nx)) {
+          fprintf(stderr, "Couldn't write row %zd of %s\n", row + m, out_path);
+          exit(-1);
+        }
+      }
+    }
+    for (k = 0; k <= P.ngrids; k++) {
+      free(in[k]);
+    }
+  }
+
+  GMT_End_IO(API, GMT_IN, 0);
+  GMT_End_IO(API, GMT_OUT, 0);
+
+  if (band_rows > 0) {
+    /*
+     * The range is only known now: if it doesn't fit the output is
+     * removed (so make won't take it for finished), and otherwise the
+     * header is updated with it
+     */
+    if (z_min > z_max) {
+      z_min = z_max = NAN;
+    }
+    if (!outputRangeFits(out_path, z_min, z_max)) {
+      unlink(nativeFileName(out_path));
+      exit(-1);
+    }
+    if ((Gout = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                    GMT_IS_FILE, GMT_IS_SURFACE,
+                    GMT_CONTAINER_ONLY, NULL, out_path, NULL)) == NULL) {
+      fprintf(stderr, "Couldn't reopen %s\n", out_path);
+      exit(-1);
+    }
+    Gout->header->z_min = z_min;
+    Gout->header->z_max = z_max;
+    if (GMT_Write_Data(API, GMT_IS_GRID,
+                GMT_IS_FILE, GMT_IS_SURFACE,
+                GMT_CONTAINER_ONLY, NULL, out_path, Gout) != 0) {
+      fprintf(stderr, "Couldn't update the header of %s\n", out_path);
+      exit(-1);
+    }
+  }
+  GMT_Destroy_Session(API);
+
+  return 0;
+}
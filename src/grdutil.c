@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libget.h"
+#include "grdutil.h"
+
+/*
+ * Byte offsets of the fields of the native binary header; the fields
+ * are packed (three 4-byte ints, then doubles), so the doubles are
+ * not aligned and have to be copied in and out with memcpy
+ */
+#define OFF_NX     0
+#define OFF_NY     4
+#define OFF_REG    8
+#define OFF_WESN   12
+#define OFF_ZMIN   44
+#define OFF_ZMAX   52
+#define OFF_INC    60
+#define OFF_SCALE  76
+#define OFF_OFFSET 84
+
+/* The 16-bit value that stands for NaN if the grid name doesn't say */
+#define SHORT_NODATA -32768
+
+/*
+ * Function nativeFileName returns (in a static buffer) the name of
+ * the file behind a GMT grid name, i.e., without any "=id+s..."
+ * format suffix
+ */
+char *nativeFileName(const char *path) {
+  static char name[1024];
+  char *p;
+
+  snprintf(name, sizeof(name), "%s", path);
+  if ((p = strchr(name, '=')) != NULL) {
+    *p = '\0';
+  }
+  return name;
+}
+
+/*
+ * Function shortGridFormat returns 1 if the grid name "path" asks
+ * GMT for 16-bit integers (the "ns" or "bs" format, e.g.,
+ * "global_vs30.grd=ns+s0.0625+o2048+n-32768"), 0 otherwise; for a
+ * 16-bit grid it also returns the scale and offset (z = scale *
+ * stored value + offset; 1 and 0 if not given) and the stored value
+ * that stands for NaN (SHORT_NODATA if not given)
+ */
+int shortGridFormat(const char *path, double *scale, double *offset,
+                    int *nodata) {
+  const char *p = strchr(path, '=');
+
+  *scale = 1;
+  *offset = 0;
+  *nodata = SHORT_NODATA;
+  if (p == NULL || (strncmp(p + 1, "ns", 2) != 0 && strncmp(p + 1, "bs", 2) != 0)) {
+    return 0;
+  }
+  for (p = strchr(p, '+'); p != NULL; p = strchr(p + 1, '+')) {
+    switch (p[1]) {
+      case 's':
+        *scale = atof(p + 2);
+        break;
+      case 'o':
+        *offset = atof(p + 2);
+        break;
+      case 'n':
+        *nodata = atoi(p + 2);
+        break;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Function mapNativeGrid maps the native binary grid "path" (float,
+ * or scaled 16-bit integers; the size of the file tells which) into
+ * memory (read-only, or shared and writable so that stores go
+ * straight to the file) and fills in ng from its header. The scale
+ * and offset of a 16-bit grid come from its header, and the value
+ * that stands for NaN from the "+n" of the name (see
+ * shortGridFormat). Returns 0 on success, or -1 (with a message) if
+ * the file can't be mapped or isn't a native binary grid of either
+ * kind.
+ */
+int mapNativeGrid(const char *path, struct nativeGrid *ng, int writable) {
+  const char *name = nativeFileName(path);
+  struct stat sbuf;
+  int32_t n[3];
+  double scale, offset, s_scale, s_offset;
+  size_t npts;
+
+  memset(ng, 0, sizeof(*ng));
+  ng->fd = -1;
+  ng->writable = writable;
+
+  if ((ng->fd = open(name, writable ? O_RDWR : O_RDONLY)) < 0 ||
+      fstat(ng->fd, &sbuf) != 0) {
+    fprintf(stderr, "Couldn't open %s\n", name);
+    goto fail;
+  }
+  if ((size_t)sbuf.st_size < NATIVE_HEADER_SIZE) {
+    fprintf(stderr, "%s is too short to be a native binary grid\n", name);
+    goto fail;
+  }
+  ng->length = sbuf.st_size;
+  if ((ng->base = mmap(NULL, ng->length,
+                       writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                       MAP_SHARED, ng->fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map %s\n", name);
+    ng->base = NULL;
+    goto fail;
+  }
+
+  memcpy(n, ng->base + OFF_NX, sizeof(n));
+  memcpy(ng->wesn, ng->base + OFF_WESN, sizeof(ng->wesn));
+  memcpy(&ng->z_min, ng->base + OFF_ZMIN, sizeof(double));
+  memcpy(&ng->z_max, ng->base + OFF_ZMAX, sizeof(double));
+  memcpy(ng->inc, ng->base + OFF_INC, sizeof(ng->inc));
+  memcpy(&scale, ng->base + OFF_SCALE, sizeof(double));
+  memcpy(&offset, ng->base + OFF_OFFSET, sizeof(double));
+  ng->nx = n[0];
+  ng->ny = n[1];
+  ng->registration = n[2];
+
+  /* The size is the only way to tell the float grids from the others */
+  npts = ng->nx * ng->ny;
+  if (n[0] > 0 && n[1] > 0 &&
+      ng->length == NATIVE_HEADER_SIZE + npts * sizeof(short)) {
+    shortGridFormat(path, &s_scale, &s_offset, &ng->nodata);
+    if (scale == 0) {
+      fprintf(stderr, "%s has a scale of 0\n", name);
+      goto fail;
+    }
+    ng->scale = scale;
+    ng->offset = offset;
+    ng->sdata = (short *)(ng->base + NATIVE_HEADER_SIZE);
+    return 0;
+  }
+  if (n[0] <= 0 || n[1] <= 0 ||
+      ng->length != NATIVE_HEADER_SIZE + npts * sizeof(float)) {
+    fprintf(stderr, "%s is not a native binary float or 16-bit grid\n", name);
+    goto fail;
+  }
+  if (scale != 1 || offset != 0) {
+    fprintf(stderr, "%s is scaled (scale %g, offset %g); can't map it\n",
+            name, scale, offset);
+    goto fail;
+  }
+  ng->scale = 1;
+  ng->offset = 0;
+  ng->data = (float *)(ng->base + NATIVE_HEADER_SIZE);
+  return 0;
+
+fail:
+  if (ng->base != NULL) {
+    munmap(ng->base, ng->length);
+  }
+  if (ng->fd >= 0) {
+    close(ng->fd);
+  }
+  memset(ng, 0, sizeof(*ng));
+  ng->fd = -1;
+  return -1;
+}
+
+/*
+ * Function nativeValue returns grid point k (counting along the rows
+ * from the NW corner) of a mapped grid
+ */
+float nativeValue(const struct nativeGrid *ng, size_t k) {
+  short s;
+
+  if (ng->data != NULL) {
+    return ng->data[k];
+  }
+  s = ng->sdata[k];
+  return s == ng->nodata ? NAN : (float)(ng->scale * s + ng->offset);
+}
+
+/*
+ * Function putNativeValues stores the n values v in a writable mapped
+ * grid, starting at grid point k. On a 16-bit grid each value is
+ * rounded to the nearest multiple of the scale (from the offset),
+ * NaN is stored as the nodata value, and values beyond the range the
+ * 16 bits can hold are stored as the nearest end of it; returns the
+ * number of values that had to be clipped that way.
+ */
+size_t putNativeValues(struct nativeGrid *ng, size_t k, const float *v,
+                       size_t n) {
+  long lo = ng->nodata == -32768 ? -32767 : -32768;
+  long hi = ng->nodata == 32767 ? 32766 : 32767;
+  size_t i, nclip = 0;
+  double d;
+  long q;
+
+  if (ng->data != NULL) {
+    memcpy(ng->data + k, v, n * sizeof(float));
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (isnan(v[i])) {
+      ng->sdata[k + i] = ng->nodata;
+      continue;
+    }
+    d = (v[i] - ng->offset) / ng->scale;
+    if (d <= lo - 0.5 || d >= hi + 0.5) {
+      q = d < lo ? lo : hi;
+      nclip++;
+    } else {
+      q = lrint(d);
+    }
+    if (q == ng->nodata) {
+      q += q < hi ? 1 : -1;
+    }
+    ng->sdata[k + i] = (short)q;
+  }
+  return nclip;
+}
+
+/*
+ * Function setNativeRange stores a new data range in the header of a
+ * writable mapped grid
+ */
+void setNativeRange(struct nativeGrid *ng, double z_min, double z_max) {
+  ng->z_min = z_min;
+  ng->z_max = z_max;
+  memcpy(ng->base + OFF_ZMIN, &z_min, sizeof(double));
+  memcpy(ng->base + OFF_ZMAX, &z_max, sizeof(double));
+}
+
+/*
+ * Function unmapNativeGrid flushes any changes to the file (and marks
+ * it modified) and unmaps it; returns 0 on success, -1 if the flush
+ * failed
+ */
+int unmapNativeGrid(struct nativeGrid *ng) {
+  int status = 0;
+
+  if (ng->base == NULL) {
+    return 0;
+  }
+  if (ng->writable) {
+    if (msync(ng->base, ng->length, MS_SYNC) != 0) {
+      status = -1;
+    }
+    futimens(ng->fd, NULL);
+  }
+  munmap(ng->base, ng->length);
+  close(ng->fd);
+  memset(ng, 0, sizeof(*ng));
+  ng->fd = -1;
+  return status;
+}
+
+/*
+ * Function hashFile computes the 64-bit FNV-1a hash of the contents
+ * of the file behind the grid name "path"; returns 0 on success, -1
+ * (with a message) if the file can't be read
+ */
+int hashFile(const char *path, unsigned long long *hash) {
+  const char *name = nativeFileName(path);
+  unsigned char *buf;
+  size_t n, i;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  FILE *fp;
+
+  if ((fp = fopen(name, "rb")) == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", name);
+    return -1;
+  }
+  if ((buf = (unsigned char *)malloc(1 << 20)) == NULL) {
+    fprintf(stderr, "No memory to hash %s\n", name);
+    fclose(fp);
+    return -1;
+  }
+  while ((n = fread(buf, 1, 1 << 20, fp)) > 0) {
+    for (i = 0; i < n; i++) {
+      h = (h ^ buf[i]) * 0x100000001b3ULL;
+    }
+  }
+  n = ferror(fp);
+  fclose(fp);
+  free(buf);
+  if (n) {
+    fprintf(stderr, "Couldn't read %s\n", name);
+    return -1;
+  }
+  *hash = h;
+  return 0;
+}
+
+/*
+ * Function bilinear interpolates between the four grid points around
+ * a point: z00 is the one to the upper left (the lower column and
+ * row numbers), z10 the next one along the row, z01 the next one
+ * down the column, and z11 the one diagonally across; tx and ty
+ * (0 to 1) are how far the point is along the row and down the
+ * column. As in GMT, grid points that are NaN are left out and the
+ * weights of the others renormalized, unless they add up to less
+ * than 0.5, in which case the result is NaN.
+ */
+double bilinear(float z00, float z10, float z01, float z11,
+                double tx, double ty) {
+  double w[4], wsum = 0, zsum = 0;
+  float z[4];
+  int k;
+
+  z[0] = z00; z[1] = z10; z[2] = z01; z[3] = z11;
+  w[0] = (1 - tx) * (1 - ty);
+  w[1] = tx * (1 - ty);
+  w[2] = (1 - tx) * ty;
+  w[3] = tx * ty;
+  for (k = 0; k < 4; k++) {
+    if (w[k] != 0 && !isnan(z[k])) {
+      wsum += w[k];
+      zsum += w[k] * z[k];
+    }
+  }
+  return wsum < 0.5 ? NAN : zsum / wsum;
+}
+
+/*
+ * Function getStringPar is getpar(name, "s", val) for a buffer val of
+ * size bytes: getpar copies a string parameter without checking its
+ * length, so it is read into getpar's own (MAXVALUE) buffer and
+ * exits with an error if it won't fit in val. Returns 1 if the
+ * parameter was given (with a value), 0 (leaving val alone) if not.
+ */
+int getStringPar(char *name, char *val, size_t size) {
+  char *s;
+
+  if ((s = getspar(name, NULL)) == NULL) {
+    return 0;
+  }
+  if (strlen(s) >= size) {
+    fprintf(stderr, "%s=%s is too long (at most %zd characters)\n",
+            name, s, size - 1);
+    exit(-1);
+  }
+  strcpy(val, s);
+  free(s);
+  return 1;
+}
@@ -0,0 +1,51 @@
+/*
+ *  grdutil.h include file.
+ *
+ *  Routines for memory-mapping GMT native binary grids (the "bf"
+ *  format: an 892-byte header followed by the grid points, a row at
+ *  a time from the north edge to the south edge, or the "bs" format,
+ *  the same with the points stored as scaled 16-bit integers), so
+ *  that programs can read or update parts of a grid without going
+ *  through the whole file, and for telling when a grid file has
+ *  changed; the interpolation used to sample grids at points; and
+ *  reading a string parameter into a buffer of a fixed size.
+ */
+
+#ifndef _GRDUTIL_H
+#define _GRDUTIL_H 1
+
+#include <stddef.h>
+
+#define NATIVE_HEADER_SIZE 892
+
+struct nativeGrid {
+  int fd;
+  int writable;
+  size_t nx, ny;          /* columns and rows */
+  int registration;       /* 0 = gridline, 1 = pixel */
+  double wesn[4];         /* west, east, south, north */
+  double inc[2];          /* x and y increments */
+  double z_min, z_max;
+  size_t length;          /* bytes mapped (the whole file) */
+  char *base;             /* start of the mapping (the header) */
+  float *data;            /* the NW grid point; rows run north to south */
+  short *sdata;           /* the same, for a "bs" grid (data is NULL) */
+  double scale, offset;   /* a "bs" point is scale * sdata + offset */
+  int nodata;             /* the sdata value that stands for NaN */
+};
+
+extern char *nativeFileName(const char *path);
+extern int   shortGridFormat(const char *path, double *scale, double *offset,
+                             int *nodata);
+extern int   mapNativeGrid(const char *path, struct nativeGrid *ng, int writable);
+extern float nativeValue(const struct nativeGrid *ng, size_t k);
+extern size_t putNativeValues(struct nativeGrid *ng, size_t k,
+                              const float *v, size_t n);
+extern void  setNativeRange(struct nativeGrid *ng, double z_min, double z_max);
+extern int   unmapNativeGrid(struct nativeGrid *ng);
+extern int   hashFile(const char *path, unsigned long long *hash);
+extern double bilinear(float z00, float z10, float z01, float z11,
+                       double tx, double ty);
+extern int   getStringPar(char *name, char *val, size_t size);
+
+#endif
@@ -5,201 +5,841 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <gmt.h>
 
 #include "libget.h"
+#include "grdutil.h"
+#include "ncformat.h"
 
 /*
- * gin is a base map into which we want to insert grid2 using
- * the weighted clipping mask gmask; all three input files must
- * be the same resolution and co-registered; grid2 and gmask must
- * be the same size and cover the exact same area, as well; the 
- * output file, gout, is the same size as gin
+ * gin is a base map into which we want to insert grid1, grid2, ...
+ * using the weighted clipping masks gmask1, gmask2, ...; all of the
+ * input files must be the same resolution and co-registered; each
+ * grid and its mask must be the same size and cover the exact same
+ * area, as well; the output file, gout, is the same size as gin
+ *
+ * The headers of all of the regions are read (and checked) first,
+ * then the base map; the regions are then read one at a time, blended
+ * into the base map in place (only over the rows and columns they
+ * cover), and freed, so at most the base map and one region are in
+ * memory at once. The regions are blended in order of priority
+ * (priority1, priority2, ..., which default to 1, 2, ...), lowest
+ * first, so where regions overlap the highest priority goes in last
+ * and wins; regions with equal priorities go in the order they were
+ * given on the command line.
+ *
+ * The optional argument "threads" (default 1; 0 means one per
+ * processor) lets regions that don't overlap go in at the same time.
+ * The regions are sorted into waves: a region goes in the wave after
+ * the last one holding a region (ahead of it in priority order) whose
+ * bounding box overlaps its own, so the regions within a wave are
+ * disjoint and can be blended in any order, while overlapping regions
+ * still go in one after another in priority order. The output does
+ * not depend on the number of threads. The GMT reads are done one at
+ * a time, but each thread holds its own region, so the peak memory is
+ * the base map plus the "threads" largest regions.
+ *
+ * With inplace=1 (which needs cache=file, below), an existing gout
+ * is updated where it sits rather than rewritten: gout must be a GMT
+ * native binary float or 16-bit grid (give it as, e.g.,
+ * gout=global_vs30.grd=bf, or =bs with its +s, +o, and +n) made from
+ * the same gin, which must not have changed since (i.e., gout must be
+ * newer than gin). gout is memory-mapped, the bounding boxes of the
+ * regions to be redone are read from gin (just over those boxes), the
+ * regions are blended into the boxes, and the boxes are stored in the
+ * mapped grid, so only the rows and columns the regions cover are
+ * read or written. If gout doesn't exist yet, is older than
+ * gin, doesn't match it, or has no usable provenance file, it is 
+ * built from scratch as usual (and can be updated in place the next
+ * time).
+ *
+ * With cache=file (which turns on inplace=1), insert_grd keeps a
+ * provenance file next to gout that records, for each region, a hash
+ * of its grid and mask and the bounding box it covers (and, for gin,
+ * its size and modification time). On the next run only the boxes
+ * of the regions whose grid, mask, or box changed, or that now go in
+ * before or after one of the regions they overlap that they didn't
+ * before (and of any region that was dropped), are restored from
+ * gin, and only the
+ * regions that overlap those boxes are read and blended again, just
+ * within the boxes. Overlapping boxes are merged first, so no point
+ * is blended twice. The cache is deleted before gout is touched and
+ * written again once gout is complete, so an interrupted run leads
+ * to gout being made from scratch the next time rather than a bad
+ * map. inplace=1 without a cache is refused: there would be no
+ * record of a region dropped since the last run, and its old blend
+ * would stay in gout.
+ *
+ * When gout is (re)written as netCDF, "chunk" and "deflate" set the
+ * size of its tiles and their compression (see ncformat.c).
  */
 
 const float defaultVs30 = 601.0;
 
+#define MAX_REGIONS 256
+
+/* Rows r0 to r1 - 1 and columns c0 to c1 - 1 of gin */
+struct box {
+  size_t r0, r1;
+  size_t c0, c1;
+};
+
+/* A region to insert: its files, priority, and where it goes in gin */
+struct region {
+  char grid[256];
+  char mask[256];
+  int priority;
+  int order;
+  struct GMT_GRID *G;
+  struct GMT_GRID *Gmask;
+  size_t nburn;   /* rows of gin above the region */
+  size_t npre;    /* columns of gin left of the region */
+  size_t nrows;   /* size of the region */
+  size_t ncols;
+  struct box box; /* what it covers of gin */
+  int wave;       /* regions in the same wave don't overlap */
+  int dirty;      /* needs to be blended (again) */
+  unsigned long long hgrid, hmask;  /* hashes of the grid and mask */
+};
+
+/* What the cache says about a region (or gin) the last time */
+struct cacheEntry {
+  char grid[256];
+  char mask[256];
+  int priority;
+  int order;
+  unsigned long long hgrid, hmask;
+  struct box box;
+  int seen;
+};
+
 char *mysprint(const char *fmt, int value);
 
+/*
+ * Function byPriority orders regions by priority, then by the order
+ * in which they were given
+ */
+int byPriority(const void *a, const void *b) {
+  const struct region *ra = (const struct region *)a;
+  const struct region *rb = (const struct region *)b;
+
+  if (ra->priority != rb->priority) {
+    return ra->priority < rb->priority ? -1 : 1;
+  }
+  return ra->order - rb->order;
+}
+
+/*
+ * Function restoreBox copies box B of gin (whose header is hin) into
+ * buf, so the regions can be blended into it afresh
+ */
+void restoreBox(void *API, const char *gin, struct GMT_GRID_HEADER *hin,
+                float *buf, const struct box *B) {
+  struct GMT_GRID *Gsub;
+  double wesn[4];
+  size_t nx, ny;
+  int reg = hin->registration;
+
+  wesn[GMT_XLO] = hin->wesn[GMT_XLO] + B->c0 * hin->inc[0];
+  wesn[GMT_XHI] = hin->wesn[GMT_XLO] + (B->c1 - 1 + reg) * hin->inc[0];
+  wesn[GMT_YHI] = hin->wesn[GMT_YHI] - B->r0 * hin->inc[1];
+  wesn[GMT_YLO] = hin->wesn[GMT_YHI] - (B->r1 - 1 + reg) * hin->inc[1];
+
+  if ((Gsub = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_AND_DATA, wesn,
+                  (char *)gin, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't read %s over rows %zd-%zd, columns %zd-%zd\n",
+            gin, B->r0, B->r1 - 1, B->c0, B->c1 - 1);
+    exit(-1);
+  }
+  nx = B->c1 - B->c0;
+  ny = B->r1 - B->r0;
+  if (Gsub->header->n_columns != nx || Gsub->header->n_rows != ny) {
+    fprintf(stderr, "Error: %s over rows %zd-%zd is %dx%d, expected %zdx%zd\n",
+            gin, B->r0, B->r1 - 1, Gsub->header->n_columns,
+            Gsub->header->n_rows, nx, ny);
+    exit(-1);
+  }
+  memcpy(buf, Gsub->data, nx * ny * sizeof(float));
+  GMT_Destroy_Data(API, &Gsub);
+}
+
+/*
+ * Function boxesOverlap returns 1 if boxes a and b share any grid
+ * points, 0 otherwise
+ */
+int boxesOverlap(const struct box *a, const struct box *b) {
+  return a->r0 < b->r1 && b->r0 < a->r1 &&
+         a->c0 < b->c1 && b->c0 < a->c1;
+}
+
+/*
+ * Function mergeBoxes replaces any two of the n boxes that overlap
+ * with the box that covers both, until none overlap; returns the
+ * number of boxes left
+ */
+int mergeBoxes(struct box *boxes, int n) {
+  int i, j, merged = 1;
+
+  while (merged) {
+    merged = 0;
+    for (i = 0; i < n; i++) {
+      for (j = i + 1; j < n; j++) {
+        if (boxesOverlap(&boxes[i], &boxes[j])) {
+          if (boxes[j].r0 < boxes[i].r0) boxes[i].r0 = boxes[j].r0;
+          if (boxes[j].r1 > boxes[i].r1) boxes[i].r1 = boxes[j].r1;
+          if (boxes[j].c0 < boxes[i].c0) boxes[i].c0 = boxes[j].c0;
+          if (boxes[j].c1 > boxes[i].c1) boxes[i].c1 = boxes[j].c1;
+          boxes[j--] = boxes[--n];
+          merged = 1;
+        }
+      }
+    }
+  }
+  return n;
+}
+
+/*
+ * Function readCache reads the provenance file "path" into entries
+ * (the first of which is gin: its name, and its size and time in
+ * place of the hashes); returns the number of regions, or -1 if
+ * there's no usable cache
+ */
+int readCache(const char *path, struct cacheEntry *entries) {
+  FILE *fp;
+  char line[1024];
+  int n = -1;
+  struct cacheEntry *E;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#') {
+      continue;
+    }
+    if (n < 0) {
+      E = &entries[0];
+      if (sscanf(line, "gin %255s %llu %llu", E->grid, &E->hgrid, &E->hmask) != 3) {
+        break;
+      }
+      n = 0;
+      continue;
+    }
+    if (n == MAX_REGIONS) {
+      n = -1;
+      break;
+    }
+    E = &entries[++n];
+    if (sscanf(line, "region %255s %255s %d %d %llx %llx %zd %zd %zd %zd",
+               E->grid, E->mask, &E->priority, &E->order,
+               &E->hgrid, &E->hmask, &E->box.r0, &E->box.r1,
+               &E->box.c0, &E->box.c1) != 10) {
+      n = -1;
+      break;
+    }
+  }
+  fclose(fp);
+  return n;
+}
+
+/*
+ * Function writeCache writes the provenance file "path" for gin
+ * (whose status is sbuf_in) and the nregions regions
+ */
+void writeCache(const char *path, const char *gin, const struct stat *sbuf_in,
+                const struct region *regions, int nregions) {
+  FILE *fp;
+  int k;
+  const struct region *R;
+
+  if ((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "Couldn't write %s\n", path);
+    exit(-1);
+  }
+  fprintf(fp, "# insert_grd provenance: don't edit; delete to force a full update\n");
+  fprintf(fp, "gin %s %llu %llu\n", gin, (unsigned long long)sbuf_in->st_size,
+          (unsigned long long)sbuf_in->st_mtim.tv_sec * 1000000000ULL +
+          sbuf_in->st_mtim.tv_nsec);
+  for (k = 0; k < nregions; k++) {
+    R = &regions[k];
+    fprintf(fp, "region %s %s %d %d %016llx %016llx %zd %zd %zd %zd\n",
+            R->grid, R->mask, R->priority, R->order, R->hgrid, R->hmask,
+            R->box.r0, R->box.r1, R->box.c0, R->box.c1);
+  }
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Couldn't write %s\n", path);
+    exit(-1);
+  }
+}
+
+/*
+ * Function blendRegion blends region R (whose grid and mask have
+ * been read) into the base map "out", which is g1_nx columns wide;
+ * if "clip" isn't NULL, out holds just that box of the map and only
+ * the part of R inside of it is blended
+ */
+void blendRegion(float *out, size_t g1_nx, struct region *R,
+                 const struct box *clip) {
+  size_t i, j, g2_nx, g2_ny, i1, j0, j1, r0 = 0, c0 = 0;
+  float *outb, *g2b, *maskb;
+  float val;
+
+  g2_nx = R->G->header->n_columns;
+  g2_ny = R->G->header->n_rows;
+
+  i = 0;
+  i1 = g2_ny;
+  j0 = 0;
+  j1 = g2_nx;
+  if (clip != NULL) {
+    if (clip->r0 > R->nburn) i = clip->r0 - R->nburn;
+    if (clip->r1 < R->nburn + g2_ny) i1 = clip->r1 - R->nburn;
+    if (clip->c0 > R->npre) j0 = clip->c0 - R->npre;
+    if (clip->c1 < R->npre + g2_nx) j1 = clip->c1 - R->npre;
+    r0 = clip->r0;
+    c0 = clip->c0;
+    g1_nx = clip->c1 - clip->c0;
+  }
+
+  for ( ; i < i1; ) {
+
+    /* read, make weighted average, write */
+    outb = out + (R->nburn + i - r0) * g1_nx + R->npre + j0 - c0;
+    g2b = R->G->data + i * g2_nx;
+    maskb = R->Gmask->data + i * g2_nx;
+    for (j = j0; j < j1; j++) {
+      /* Nothing to do where the region has no weight */
+      if (maskb[j] == 0) {
+        continue;
+      }
+      val = g2b[j] * maskb[j] + outb[j - j0] * (1 - maskb[j]);
+      /*
+       * It's possible for the smoothed mask to be non-zero outside
+       * of the border (consider a region with a concave outer border
+       * like California's eastern border), so here we check and
+       * fix up the output point.
+       */
+      if (g2b[j] == 0 && maskb[j] > 0) {
+        if (outb[j - j0] == 0) {
+          fprintf(stderr,"Bad point x=%zd y=%zd, setting to %f\n",
+                  i, j, defaultVs30);
+          val = defaultVs30;
+        } else {
+          /*
+           * This is the "normal" situation; just use the background
+           * grid
+           */
+          val = outb[j - j0];
+        }
+      }
+      outb[j - j0] = val;
+    }
+    if ((++i) % 100 == 0) {
+      fprintf(stderr, "Done with %zd rows of %zd\n", i, i1);
+    }
+  }
+}
+
 int main(int ac, char **av) {
 
   /* Input files */
   char gin[256];
-  char grid2[256];
-  char gmask[256];
 
-  /* Output file */
+  /* Output file, and its provenance file */
   char gout[256];
+  char cache[256] = "";
+
+  /* The regions to insert */
+  struct region *regions, *R;
+  int nregions = 0;
 
   /* Dimensions of the input grids */
   float g1_x1, g1_x2, g1_y1, g1_y2;
-  size_t g1_nx, g1_ny;
+  size_t g1_nx;
   float g2_x1, g2_x2, g2_y1, g2_y2;
-  size_t g2_nx, g2_ny;
   float dx, dy;
 
   void *API;
-  struct GMT_GRID *G1, *G2, *Gmask, *Gout;
-  struct GMT_GRID_HEADER *G_hdr;
-  float *g2b, *maskb, *outb;
-  size_t i, j, nburn, npre;
-  float val;
-  int err;
-  int grdcnt = 0;
-  struct stat sbuf;
+  struct GMT_GRID *G1;
+  struct GMT_GRID_HEADER *h, *hm;
+  int k, kk, wave, nwaves;
+  size_t nthreads = 1, nc_chunk;
+  int nc_deflate;
+  struct stat sbuf, sbuf_in;
+  int inplace = 0, update = 0;
+  struct nativeGrid ng;
+  float *out = NULL;
+  size_t i, j;
+  double zmin, zmax;
+  struct cacheEntry *entries = NULL, *E, *EE;
+  int nentries = -1, e, b, *match = NULL, changed, was_before;
+  struct box *boxes = NULL;
+  float **bufs = NULL;
+  int nboxes = 0;
+  size_t nclip = 0, bnx;
 
   setpar(ac, av);
   mstpar("gin", "s", gin);
   mstpar("gout", "s", gout);
 
-  if (stat(gout, &sbuf) == 0) {
-    unlink(gout);
+  if ((regions = (struct region *)calloc(MAX_REGIONS + 1, sizeof(struct region))) == NULL) {
+    fprintf(stderr, "No memory for regions\n");
+    exit(-1);
   }
+  while (getpar(mysprint("grid%d", nregions + 1), "s", regions[nregions].grid)) {
+    if (nregions == MAX_REGIONS) {
+      fprintf(stderr, "Too many regions (max %d)\n", MAX_REGIONS);
+      exit(-1);
+    }
+    R = &regions[nregions++];
+    mstpar(mysprint("gmask%d", nregions), "s", R->mask);
+    R->order = nregions;
+    R->priority = nregions;
+    getpar(mysprint("priority%d", nregions), "d", &R->priority);
+  }
+  getpar("threads", "z", &nthreads);
+  getpar("inplace", "d", &inplace);
+  if (getpar("cache", "s", cache)) {
+    inplace = 1;
+  }
+  getNetCDFLayout(&nc_chunk, &nc_deflate);
+  endpar();
+
+  /*
+   * Without a provenance file there's no telling which regions went
+   * into gout last time, so one that has since been dropped would
+   * never be taken back out
+   */
+  if (inplace && cache[0] == '\0') {
+    fprintf(stderr, "inplace=1 needs cache=file\n");
+    exit(-1);
+  }
+
+#ifdef _OPENMP
+  if (nthreads == 0) {
+    nthreads = omp_get_num_procs();
+  }
+#else
+  if (nthreads > 1) {
+    fprintf(stderr, "Not compiled with OpenMP, ignoring threads=%zd\n", nthreads);
+  }
+  nthreads = 1;
+#endif
 
   API = GMT_Create_Session("insert_grd", 0, 0, NULL);
+  setNetCDFLayout(API, nc_chunk, nc_deflate);
+
+  /* Read the headers of the regions, so they can be checked up front */
+  fprintf(stderr, "Reading input headers...");
+  for (k = 0; k < nregions; k++) {
+    R = &regions[k];
+    if ((R->G = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_ONLY, NULL,
+                  R->grid, NULL)) == NULL) {
+      fprintf(stderr, "Couldn't read %s\n", R->grid);
+      exit(-1);
+    }
+    if ((R->Gmask = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_ONLY, NULL,
+                  R->mask, NULL)) == NULL) {
+      fprintf(stderr, "Couldn't read %s\n", R->mask);
+      exit(-1);
+    }
+  }
+  fprintf(stderr, "Done.\n");
+
+  /* Hash the regions' files, for the provenance file */
+  if (cache[0] != '\0') {
+    fprintf(stderr, "Hashing input grids...");
+    for (k = 0; k < nregions; k++) {
+      R = &regions[k];
+      if (hashFile(R->grid, &R->hgrid) != 0 || hashFile(R->mask, &R->hmask) != 0) {
+        exit(-1);
+      }
+    }
+    fprintf(stderr, "Done.\n");
+  }
 
-  /* Read the input grid */
-  fprintf(stderr, "Reading input files...");
   if ((G1 = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
                   GMT_IS_FILE, GMT_IS_SURFACE,
-                  GMT_CONTAINER_AND_DATA, NULL,
+                  GMT_CONTAINER_ONLY, NULL,
                   gin, NULL)) == NULL) {
     fprintf(stderr, "Couldn't read %s\n", gin);
     exit(-1);
   }
 
-  /*
-   * The output file has the same dimensions as gin
-   * so write the header, prep the output object, then open
-   * the output for writing.
-   */
-  if ((Gout = GMT_Create_Data(API, GMT_IS_GRID, GMT_IS_SURFACE,
-                  GMT_CONTAINER_AND_DATA, NULL,
-                  G1->header->wesn, G1->header->inc,
-                  GMT_GRID_NODE_REG, 0, NULL)) == NULL) {
-    fprintf(stderr, "Couldn't create %s\n", gout);
+  /* Can we update gout in place? */
+  if (stat(nativeFileName(gin), &sbuf_in) != 0) {
+    fprintf(stderr, "Couldn't stat %s\n", gin);
     exit(-1);
   }
+  if (inplace) {
+    if ((entries = (struct cacheEntry *)calloc(MAX_REGIONS + 1, sizeof(struct cacheEntry))) == NULL) {
+      fprintf(stderr, "No memory for the cache\n");
+      exit(-1);
+    }
+    if (stat(nativeFileName(gout), &sbuf) != 0) {
+      fprintf(stderr, "No %s yet, making it from scratch\n", gout);
+    } else if (sbuf.st_mtim.tv_sec < sbuf_in.st_mtim.tv_sec ||
+               (sbuf.st_mtim.tv_sec == sbuf_in.st_mtim.tv_sec &&
+                sbuf.st_mtim.tv_nsec < sbuf_in.st_mtim.tv_nsec)) {
+      fprintf(stderr, "%s is newer than %s, making it from scratch\n", gin, gout);
+    } else if (mapNativeGrid(gout, &ng, 1) == 0) {
+      if (ng.nx != G1->header->n_columns || ng.ny != G1->header->n_rows ||
+          ng.registration != (int)G1->header->registration ||
+          fabs(ng.wesn[0] - G1->header->wesn[GMT_XLO]) > 0.1 * G1->header->inc[0] ||
+          fabs(ng.wesn[3] - G1->header->wesn[GMT_YHI]) > 0.1 * G1->header->inc[1]) {
+        fprintf(stderr, "%s doesn't match %s, making it from scratch\n", gout, gin);
+        unmapNativeGrid(&ng);
+      } else if ((nentries = readCache(cache, entries)) < 0) {
+        fprintf(stderr, "No usable %s, making %s from scratch\n", cache, gout);
+        unmapNativeGrid(&ng);
+      } else if (strcmp(entries[0].grid, gin) != 0 ||
+                 entries[0].hgrid != (unsigned long long)sbuf_in.st_size ||
+                 entries[0].hmask != (unsigned long long)sbuf_in.st_mtim.tv_sec * 1000000000ULL +
+                                     sbuf_in.st_mtim.tv_nsec) {
+        fprintf(stderr, "%s has changed since %s was written, making %s from scratch\n",
+                gin, cache, gout);
+        unmapNativeGrid(&ng);
+      } else {
+        update = 1;
+      }
+    } else {
+      fprintf(stderr, "Can't update %s in place, making it from scratch\n", gout);
+    }
+  }
 
-  /* 
-   * Just copy the input to the output -- we'll insert the
-   * moasic tiles into the output grid
-   */
-  memcpy(Gout->data, G1->data, G1->header->size * sizeof(float));
+  if (!update) {
+    if (cache[0] != '\0') {
+      unlink(cache);
+    }
+    if (stat(nativeFileName(gout), &sbuf) == 0) {
+      unlink(nativeFileName(gout));
+    }
+
+    /*
+     * The blend is a weighted average of gin and the regions (or the
+     * default Vs30), so their ranges bound that of gout
+     */
+    zmin = fmin(G1->header->z_min, defaultVs30);
+    zmax = fmax(G1->header->z_max, defaultVs30);
+    for (k = 0; k < nregions; k++) {
+      zmin = fmin(zmin, regions[k].G->header->z_min);
+      zmax = fmax(zmax, regions[k].G->header->z_max);
+    }
+    checkOutputRange(gout, zmin, zmax);
+
+    /* Read the input grid; the regions are blended right into it */
+    fprintf(stderr, "Reading %s...", gin);
+    if (GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_DATA_ONLY, NULL,
+                  gin, G1) == NULL) {
+      fprintf(stderr, "Couldn't read %s\n", gin);
+      exit(-1);
+    }
+    fprintf(stderr, "Done.\n");
+    out = G1->data;
+  }
 
   g1_x1 = G1->header->wesn[GMT_XLO];
   g1_x2 = G1->header->wesn[GMT_XHI];
   g1_y1 = G1->header->wesn[GMT_YLO];
   g1_y2 = G1->header->wesn[GMT_YHI];
   g1_nx = G1->header->n_columns;
-  g1_ny = G1->header->n_rows;
 
   dx = G1->header->inc[0];
   dy = G1->header->inc[1];
 
-  while(getpar(mysprint("grid%d", ++grdcnt), "s", grid2)) {
-    mstpar(mysprint("gmask%d", grdcnt), "s", gmask);
-
-    fprintf(stderr, "Inserting grid %s\n", grid2);
-
-    if ((G2 = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
-                  GMT_IS_FILE, GMT_IS_SURFACE,
-                  GMT_CONTAINER_AND_DATA, NULL,
-                  grid2, NULL)) == NULL) {
-      fprintf(stderr, "Couldn't read %s\n", grid2);
-      exit(-1);
-    }
-    if ((Gmask = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
-                    GMT_IS_FILE, GMT_IS_SURFACE,
-                    GMT_CONTAINER_AND_DATA, NULL,
-                    gmask, NULL)) == NULL) {
-      fprintf(stderr, "Couldn't read %s\n", gmask);
-      exit(-1);
-    }
+  for (k = 0; k < nregions; k++) {
+    R = &regions[k];
+    h = R->G->header;
+    hm = R->Gmask->header;
 
-    g2_x1 = G2->header->wesn[GMT_XLO];
-    g2_x2 = G2->header->wesn[GMT_XHI];
-    g2_y1 = G2->header->wesn[GMT_YLO];
-    g2_y2 = G2->header->wesn[GMT_YHI];
-    g2_nx = G2->header->n_columns;
-    g2_ny = G2->header->n_rows;
+    g2_x1 = h->wesn[GMT_XLO];
+    g2_x2 = h->wesn[GMT_XHI];
+    g2_y1 = h->wesn[GMT_YLO];
+    g2_y2 = h->wesn[GMT_YHI];
 
     /* Do some sanity checks */
-    if (g1_x1 >= g1_x2 || g1_y1 >= g1_y2 || 
+    if (g1_x1 >= g1_x2 || g1_y1 >= g1_y2 ||
         g2_x1 >= g2_x2 || g2_y1 >= g2_y2) {
       fprintf(stderr, "Improper grid specification. x1,y1 should be < x2,y2\n");
       exit(-1);
     }
     if (g2_x1 < g1_x1 || g2_x2 > g1_x2 ||
-        g2_y1 < g1_y1 || g2_y2 > g1_y2) { 
-      fprintf(stderr, "Error: grid 2 must fit entirely within grid 1\n");
+        g2_y1 < g1_y1 || g2_y2 > g1_y2) {
+      fprintf(stderr, "Error: %s must fit entirely within %s\n", R->grid, gin);
+      exit(-1);
+    }
+    if (hm->n_columns != h->n_columns || hm->n_rows != h->n_rows) {
+      fprintf(stderr, "Error: %s and %s must be the same size\n", R->grid, R->mask);
       exit(-1);
     }
 
-    /* 
-     * burn off all the data in gin prior to the top row 
-     * of grid2 (if any); the 0.1 is just to avoid roundoff
-     * error 
+    /*
+     * burn off all the data in gin prior to the top row
+     * of the region (if any); the 0.1 is just to avoid roundoff
+     * error
      */
-    nburn = (size_t)((g1_y2 - g2_y2) / dy + 0.1);
+    R->nburn = (size_t)((g1_y2 - g2_y2) / dy + 0.1);
+
+    /* npre is the number of points in x before we get to the region */
+    R->npre  = (size_t)((g2_x1 - g1_x1) / dx + 0.1);
 
-    /* 
-     * Step through grid2: npre is the number of points in x before
-     * we get to grid2
+    R->nrows = h->n_rows;
+    R->ncols = h->n_columns;
+
+    R->box.r0 = R->nburn;
+    R->box.r1 = R->nburn + R->nrows;
+    R->box.c0 = R->npre;
+    R->box.c1 = R->npre + R->ncols;
+    R->dirty = 1;
+  }
+
+  qsort(regions, nregions, sizeof(struct region), byPriority);
+
+  /*
+   * Each region goes in the wave after the last one that holds a
+   * region it overlaps
+   */
+  nwaves = 0;
+  for (k = 0; k < nregions; k++) {
+    regions[k].wave = 0;
+    for (kk = 0; kk < k; kk++) {
+      if (regions[kk].wave >= regions[k].wave && boxesOverlap(&regions[kk].box, &regions[k].box)) {
+        regions[k].wave = regions[kk].wave + 1;
+      }
+    }
+    if (regions[k].wave + 1 > nwaves) {
+      nwaves = regions[k].wave + 1;
+    }
+  }
+
+  /*
+   * When updating in place, work out which boxes need to be redone:
+   * those of the regions that changed since the provenance file was
+   * written, and of the regions that were dropped, merged so that
+   * they don't overlap
+   */
+  if (update) {
+    if ((boxes = (struct box *)calloc(2 * MAX_REGIONS, sizeof(struct box))) == NULL ||
+        (match = (int *)calloc(MAX_REGIONS, sizeof(int))) == NULL) {
+      fprintf(stderr, "No memory for boxes\n");
+      exit(-1);
+    }
+    for (k = 0; k < nregions; k++) {
+      R = &regions[k];
+      for (e = 1; e <= nentries; e++) {
+        if (!entries[e].seen && strcmp(entries[e].grid, R->grid) == 0 &&
+            strcmp(entries[e].mask, R->mask) == 0) {
+          entries[e].seen = 1;
+          match[k] = e;
+          break;
+        }
+      }
+    }
+    for (k = 0; k < nregions; k++) {
+      R = &regions[k];
+      E = match[k] ? &entries[match[k]] : NULL;
+      changed = E == NULL || E->hgrid != R->hgrid || E->hmask != R->hmask ||
+                memcmp(&E->box, &R->box, sizeof(struct box)) != 0;
+
+      /*
+       * Priorities and orders are just for sorting (and the defaults
+       * shift whenever a region is added or dropped); what matters is
+       * whether the region now goes in before or after each region it
+       * overlaps the way it did last time (regions are sorted by now)
+       */
+      for (kk = 0; !changed && kk < nregions; kk++) {
+        if (kk == k || !match[kk] ||
+            !boxesOverlap(&R->box, &regions[kk].box)) {
+          continue;
+        }
+        EE = &entries[match[kk]];
+        was_before = EE->priority != E->priority ? EE->priority < E->priority
+                                                 : EE->order < E->order;
+        changed = was_before != (kk < k);
+      }
+      if (!changed) {
+        continue;
+      }
+      fprintf(stderr, "%s has changed\n", R->grid);
+      boxes[nboxes++] = R->box;
+      if (E != NULL) {
+        boxes[nboxes++] = E->box;
+      }
+    }
+    for (e = 1; e <= nentries; e++) {
+      if (!entries[e].seen) {
+        fprintf(stderr, "%s has been dropped\n", entries[e].grid);
+        if (entries[e].box.r1 > G1->header->n_rows ||
+            entries[e].box.c1 > G1->header->n_columns) {
+          fprintf(stderr, "Bad box for %s in %s\n", entries[e].grid, cache);
+          exit(-1);
+        }
+        boxes[nboxes++] = entries[e].box;
+      }
+    }
+    nboxes = mergeBoxes(boxes, nboxes);
+
+    /* A region has to be blended again if it overlaps any of the boxes */
+    for (k = 0; k < nregions; k++) {
+      regions[k].dirty = 0;
+      for (b = 0; b < nboxes; b++) {
+        if (boxesOverlap(&regions[k].box, &boxes[b])) {
+          regions[k].dirty = 1;
+        }
+      }
+
+      /* The others won't be read, so let their headers go now */
+      if (!regions[k].dirty) {
+        GMT_Destroy_Data(API, &regions[k].G);
+        GMT_Destroy_Data(API, &regions[k].Gmask);
+      }
+    }
+
+    /* The old provenance is no good once we start changing gout */
+    unlink(cache);
+
+    /*
+     * Put gin back in all the boxes before blending anything; the
+     * boxes are blended in memory (as floats, even if gout holds
+     * 16-bit integers) and stored in gout when they're done
      */
-    npre  = (size_t)((g2_x1 - g1_x1) / dx + 0.1);
-    for (i = 0; i < g2_ny; ) {
-
-      /* read, make weighted average, write */
-      outb = Gout->data + (nburn + i) * g1_nx;
-      g2b = G2->data + i * g2_nx;
-      maskb = Gmask->data + i * g2_nx;
-      for (j = 0; j < g2_nx; j++) {
-        val = g2b[j] * maskb[j] + outb[j+npre] * (1 - maskb[j]);
-        /* 
-         * It's possible for the smoothed mask to be non-zero outside 
-         * of the border (consider a region with a concave outer border
-         * like California's eastern border), so here we check and 
-         * fix up the output point.
-         */
-        if (g2b[j] == 0 && maskb[j] > 0) {
-          if (outb[j+npre] == 0) {
-            fprintf(stderr,"Bad point x=%zd y=%zd, setting to %f\n",
-                    i, j, defaultVs30);
-            val = defaultVs30;
-          } else {
-            /* 
-             * This is the "normal" situation; just use the background 
-             * grid 
-             */
-            val = outb[j+npre];
+    fprintf(stderr, "Restoring %s in %d boxes...", gin, nboxes);
+    if ((bufs = (float **)calloc(nboxes, sizeof(float *))) == NULL) {
+      fprintf(stderr, "No memory for boxes\n");
+      exit(-1);
+    }
+    for (b = 0; b < nboxes; b++) {
+      if ((bufs[b] = (float *)malloc((boxes[b].r1 - boxes[b].r0) *
+                                     (boxes[b].c1 - boxes[b].c0) *
+                                     sizeof(float))) == NULL) {
+        fprintf(stderr, "No memory for box %d\n", b + 1);
+        exit(-1);
+      }
+      restoreBox(API, gin, G1->header, bufs[b], &boxes[b]);
+    }
+    fprintf(stderr, "Done.\n");
+  }
+
+  for (wave = 0; wave < nwaves; wave++) {
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads) private(R, b)
+    for (k = 0; k < nregions; k++) {
+      R = &regions[k];
+      if (R->wave != wave || !R->dirty) {
+        continue;
+      }
+
+#pragma omp critical(gmt_io)
+      {
+        fprintf(stderr, "Inserting grid %s (priority %d, wave %d)\n",
+                R->grid, R->priority, wave + 1);
+        if (GMT_Read_Data(API, GMT_IS_GRID,
+                      GMT_IS_FILE, GMT_IS_SURFACE,
+                      GMT_DATA_ONLY, NULL,
+                      R->grid, R->G) == NULL) {
+          fprintf(stderr, "Couldn't read %s\n", R->grid);
+          exit(-1);
+        }
+        if (GMT_Read_Data(API, GMT_IS_GRID,
+                      GMT_IS_FILE, GMT_IS_SURFACE,
+                      GMT_DATA_ONLY, NULL,
+                      R->mask, R->Gmask) == NULL) {
+          fprintf(stderr, "Couldn't read %s\n", R->mask);
+          exit(-1);
+        }
+      }
+
+      if (update) {
+        for (b = 0; b < nboxes; b++) {
+          if (boxesOverlap(&R->box, &boxes[b])) {
+            blendRegion(bufs[b], g1_nx, R, &boxes[b]);
           }
         }
-        outb[j+npre] = val;
+      } else {
+        blendRegion(out, g1_nx, R, NULL);
       }
-      if ((++i) % 100 == 0) {
-        fprintf(stderr, "Done with %zd rows of %zd\n", i, g2_ny);
+
+      /* Done with this region, so let it go before reading the next */
+#pragma omp critical(gmt_io)
+      {
+        GMT_Destroy_Data(API, &R->G);
+        GMT_Destroy_Data(API, &R->Gmask);
+        fprintf(stderr, "Done with %s.\n", R->grid);
       }
     }
-    fprintf(stderr, "Done.\n");
   }
-  endpar();
 
-  fprintf(stderr, "Writing output...");
-  if (GMT_Write_Data(API, GMT_IS_GRID,
+  if (update) {
+    /*
+     * Store the boxes in gout, and widen the range in the header to
+     * take them in; it may end up wider than the data, but never
+     * narrower
+     */
+    zmin = ng.z_min;
+    zmax = ng.z_max;
+    for (b = 0; b < nboxes; b++) {
+      bnx = boxes[b].c1 - boxes[b].c0;
+      for (i = boxes[b].r0; i < boxes[b].r1; i++) {
+        out = bufs[b] + (i - boxes[b].r0) * bnx;
+        for (j = 0; j < bnx; j++) {
+          if (isnan(out[j])) {
+            continue;
+          }
+          if (isnan(zmin) || out[j] < zmin) zmin = out[j];
+          if (isnan(zmax) || out[j] > zmax) zmax = out[j];
+        }
+        nclip += putNativeValues(&ng, i * g1_nx + boxes[b].c0, out, bnx);
+      }
+      free(bufs[b]);
+    }
+    free(bufs);
+    if (nclip > 0) {
+      fprintf(stderr, "Warning: %zd points were out of the range %s can hold "
+              "and were clipped\n", nclip, gout);
+    }
+    setNativeRange(&ng, zmin, zmax);
+    fprintf(stderr, "Updating %s...", gout);
+    if (unmapNativeGrid(&ng) != 0) {
+      fprintf(stderr, "Couldn't write %s\n", gout);
+      exit(-1);
+    }
+    fprintf(stderr, "Done.\n");
+    free(boxes);
+    free(match);
+  } else {
+    fprintf(stderr, "Writing output...");
+    if (GMT_Write_Data(API, GMT_IS_GRID,
               GMT_IS_FILE, GMT_IS_SURFACE,
               GMT_CONTAINER_AND_DATA, NULL,
-              gout, Gout) != 0) {
-    fprintf(stderr, "Couldn't write %s\n", gout);
-    exit(-1);
+              gout, G1) != 0) {
+      fprintf(stderr, "Couldn't write %s\n", gout);
+      exit(-1);
+    }
+    fprintf(stderr, "Done.\n");
+  }
+
+  /* gout is complete, so record what went into it */
+  if (cache[0] != '\0') {
+    writeCache(cache, gin, &sbuf_in, regions, nregions);
   }
-  fprintf(stderr, "Done.\n");
 
   GMT_End_IO(API, GMT_IN, 0);
   GMT_End_IO(API, GMT_OUT, 0);
   GMT_Destroy_Session(API);
 
+  free(entries);
+  free(regions);
   exit(0);
 }
 
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <gmt.h>
+
+#include "libget.h"
+#include "grdutil.h"
+#include "ncformat.h"
+
+/*
+ * make_weights: make the weighted clipping mask (weights.grd) that
+ * insert_grd uses to blend a regional map into the global one
+ *
+ * This does in one pass, in memory, what the regional Makefiles used
+ * to do with a chain of grdmath and smooth steps, each of which wrote
+ * out a full grid for the next one to read back:
+ *
+ *   region    = region_file > value    (test=gt, the default), or
+ *               region_file != value   (test=ne)
+ *   clipmask  = (watermask + region) > 0
+ *   mask_a    = smooth(clipmask) * landmask
+ *   new_mask  = core + NOT(core) * smooth(landmask)
+ *   final     = mask_a + new_mask * landmask - 1, or 0 where that's < 0
+ *   weights   = 2 * (final - 0.5), or 0 where that's <= 0
+ *
+ * where "core" is the region (core=region, the default) or the clip
+ * mask (core=clip, as in PNW and the Amplification maps), and both
+ * smooths are fx by fy boxcars. With stretch=0 the output is "final"
+ * rather than "weights". Each grdmath step is done in double and
+ * rounded to float, as grdmath does, and the boxcars are the same
+ * float running sums as smooth's, so (with threads=1) the output is
+ * the same as the chain's, bit for bit. Where region_file is NaN the
+ * region is taken to be 0 (as the "0 AND" in most of the chains
+ * does), or 1 with nan_region=1 (as the "1 AND" in the Amplification
+ * chains does).
+ *
+ * If no landmask_file is given (a region with no coastline, like
+ * Utah) the output is just the smoothed region (stretched, unless
+ * stretch=0). watermask_file, if not given, is taken to be
+ * 1 - landmask. All of the grids must be the same size.
+ *
+ * The two boxcars run together: the column sums of the clip mask and
+ * the landmask are kept side by side and each row of both smoothed
+ * grids is made, combined into the output, and thrown away, so the
+ * only full grids in memory are the inputs, the clip mask, and the
+ * output. With threads=N the rows are split into N strips, as in
+ * smooth (the sums are then primed separately for each strip, so the
+ * output may differ from the chain's in the last bit). A netCDF
+ * output is tiled and compressed as "chunk" and "deflate" say (see
+ * ncformat.c).
+ */
+
+/* How the region is picked out of region_file */
+#define TEST_GT 0
+#define TEST_NE 1
+
+static int test = TEST_GT;
+static double value = 0;
+static int nan_region = 0;
+
+/*
+ * Function isRegion returns 1 if grid value g is inside the region,
+ * 0 if not (or nan_region if g is NaN)
+ */
+static inline float isRegion(float g) {
+  if (isnan(g)) {
+    return nan_region;
+  }
+  return test == TEST_GT ? (g > value) : (g != value);
+}
+
+/*
+ * Function filterRow2 runs the boxcar across a row for one or two
+ * sets of column sums (each the sum of n_rows points) at once: sum_a
+ * into out_a, and sum_b into out_b unless sum_b is NULL. It rolls in
+ * and out at the edges and keeps its running sums in float, exactly
+ * as smooth does
+ */
+void filterRow2(const float *sum_a, const float *sum_b, float *out_a,
+                float *out_b, size_t nx, size_t fx, size_t n_rows) {
+  size_t i, first_col, last_col, n_cols;
+  float row_a = 0, row_b = 0;
+
+  first_col = 0;
+  last_col  = fx / 2;
+  n_cols = last_col - first_col + 1;
+
+  for (i = first_col; i <= last_col; i++) {
+    row_a += sum_a[i];
+    if (sum_b) row_b += sum_b[i];
+  }
+
+  for (i = 0; i < nx; i++) {
+    out_a[i] = row_a / (n_rows * n_cols);
+    if (sum_b) out_b[i] = row_b / (n_rows * n_cols);
+
+    /* Drop a column on the left once we're done rolling in... */
+    if (last_col >= (fx - 1)) {
+      row_a -= sum_a[first_col];
+      if (sum_b) row_b -= sum_b[first_col];
+      first_col++;
+    }
+    /* ...and add one on the right until we start rolling out */
+    if (last_col < (nx - 1)) {
+      last_col++;
+      row_a += sum_a[last_col];
+      if (sum_b) row_b += sum_b[last_col];
+    }
+    n_cols = last_col - first_col + 1;
+  }
+}
+
+/*
+ * Function addRows adds (sign = 1) or drops (sign = -1) row j of
+ * the clip mask (and of the landmask, if any) to or from the column
+ * sums
+ */
+static inline void addRows(const float *clip, const float *land,
+                           float *sum_c, float *sum_l, size_t nx,
+                           size_t j, int sign) {
+  size_t i;
+  const float *c = clip + j * nx;
+  const float *l = land ? land + j * nx : NULL;
+
+  if (sign > 0) {
+    for (i = 0; i < nx; i++) sum_c[i] += c[i];
+    if (l) for (i = 0; i < nx; i++) sum_l[i] += l[i];
+  } else {
+    for (i = 0; i < nx; i++) sum_c[i] -= c[i];
+    if (l) for (i = 0; i < nx; i++) sum_l[i] -= l[i];
+  }
+}
+
+/*
+ * Function combineRow turns a row of the smoothed clip mask (cs) and
+ * smoothed landmask (ls) into a row of the output, following the
+ * grdmath steps one by one (each in double, rounded to float)
+ */
+void combineRow(const float *region, const float *clip, const float *land,
+                const float *cs, const float *ls, float *out, size_t nx,
+                int clip_core, int stretch) {
+  size_t i;
+  float n, core, a, m, mm, s, f, x;
+
+  for (i = 0; i < nx; i++) {
+    if (land == NULL) {
+      f = cs[i];
+    } else {
+      n = isRegion(region[i]);
+      core = clip_core ? clip[i] : n;
+      a  = (double)cs[i] * land[i];                      /* mask_a */
+      m  = (double)(float)((double)(core == 0) * ls[i]); /* NOT(core) * ls */
+      m  = (double)core + m;                             /* new_mask */
+      mm = (double)m * land[i];
+      s  = (double)(float)((double)a + mm) - 1;
+      f  = (double)s * (s >= 0);                         /* final_mask */
+    }
+    if (stretch) {
+      x = (double)(float)((double)f - 0.5) * 2;
+      out[i] = (double)x * (x > 0);                      /* weights */
+    } else {
+      out[i] = f;
+    }
+  }
+}
+
+/*
+ * Function weightsStrip makes output rows j0 through j1 - 1, using
+ * sum_c, sum_l, row_c, and row_l (nx floats each) as workspace
+ */
+void weightsStrip(const float *region, const float *clip, const float *land,
+                  float *out, float *sum_c, float *sum_l, float *row_c,
+                  float *row_l, size_t nx, size_t ny, size_t fx, size_t fy,
+                  size_t j0, size_t j1, int clip_core, int stretch,
+                  size_t *ndone) {
+  size_t j, done;
+  size_t first_row, last_row;
+
+  memset((void *)sum_c, 0, nx * sizeof(float));
+  memset((void *)sum_l, 0, nx * sizeof(float));
+
+  first_row = j0 > fy / 2 ? j0 - fy / 2 : 0;
+  last_row  = j0 + fy / 2 < ny - 1 ? j0 + fy / 2 : ny - 1;
+  for (j = first_row; j <= last_row; j++) {
+    addRows(clip, land, sum_c, sum_l, nx, j, 1);
+  }
+
+  for (j = j0; j < j1; j++) {
+    filterRow2(sum_c, land ? sum_l : NULL, row_c, row_l, nx, fx,
+               last_row - first_row + 1);
+    combineRow(region + j * nx, clip + j * nx, land ? land + j * nx : NULL,
+               row_c, row_l, out + j * nx, nx, clip_core, stretch);
+
+    /* Shift down a row, rolling in and out as smooth does */
+    if (j >= fy / 2) {
+      addRows(clip, land, sum_c, sum_l, nx, first_row, -1);
+      first_row++;
+    }
+    if (last_row < (ny - 1)) {
+      last_row++;
+      addRows(clip, land, sum_c, sum_l, nx, last_row, 1);
+    }
+
+#pragma omp atomic capture
+    done = ++(*ndone);
+    if (done % 100 == 0) {
+      fprintf(stderr, "Done with %zd of %zd rows\n", done, ny);
+    }
+  }
+}
+
+/*
+ * Function readGrid reads grid "path", checking (if like isn't NULL)
+ * that it is the same size as "like"
+ */
+struct GMT_GRID *readGrid(void *API, const char *path, struct GMT_GRID *like) {
+  struct GMT_GRID *G;
+
+  fprintf(stderr, "Reading %s...", path);
+  if ((G = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_AND_DATA, NULL,
+                  (char *)path, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't read %s\n", path);
+    exit(-1);
+  }
+  fprintf(stderr, "Done.\n");
+  if (like != NULL && (G->header->n_columns != like->header->n_columns ||
+                       G->header->n_rows != like->header->n_rows)) {
+    fprintf(stderr, "Error: %s must be the same size as the region grid\n", path);
+    exit(-1);
+  }
+  return G;
+}
+
+int main(int ac, char **av) {
+
+  /* Input files */
+  char region_path[256];
+  char land_path[256];
+  char water_path[256];
+
+  /* Output file */
+  char out_path[256];
+
+  /* Options */
+  char test_name[16] = "gt";
+  char core_name[16] = "region";
+  size_t fx, fy;
+  int stretch = 1;
+  int clip_core;
+  size_t nthreads = 1, nc_chunk;
+  int nc_deflate;
+  int have_land, have_water;
+
+  void *API;
+  struct GMT_GRID *Gregion, *Gland = NULL, *Gwater = NULL, *Gout;
+  float *clip, *land, *work;
+  size_t nx, ny, i, k, ndone = 0;
+  struct stat sbuf;
+
+  setpar(ac, av);
+  mstpar("region_file", "s", region_path);
+  mstpar("outfile", "s", out_path);
+  mstpar("fx", "z", &fx);
+  mstpar("fy", "z", &fy);
+  have_land = getpar("landmask_file", "s", land_path);
+  have_water = getpar("watermask_file", "s", water_path);
+  getStringPar("test", test_name, sizeof(test_name));
+  getpar("value", "F", &value);
+  getStringPar("core", core_name, sizeof(core_name));
+  getpar("nan_region", "d", &nan_region);
+  getpar("stretch", "d", &stretch);
+  getpar("threads", "z", &nthreads);
+  getNetCDFLayout(&nc_chunk, &nc_deflate);
+  endpar();
+
+  if (strcmp(test_name, "gt") == 0) {
+    test = TEST_GT;
+  } else if (strcmp(test_name, "ne") == 0) {
+    test = TEST_NE;
+  } else {
+    fprintf(stderr, "Unknown test %s (must be gt or ne)\n", test_name);
+    exit(-1);
+  }
+  if (strcmp(core_name, "region") == 0) {
+    clip_core = 0;
+  } else if (strcmp(core_name, "clip") == 0) {
+    clip_core = 1;
+  } else {
+    fprintf(stderr, "Unknown core %s (must be region or clip)\n", core_name);
+    exit(-1);
+  }
+  if (have_water && !have_land) {
+    fprintf(stderr, "watermask_file needs a landmask_file\n");
+    exit(-1);
+  }
+
+#ifdef _OPENMP
+  if (nthreads == 0) {
+    nthreads = omp_get_num_procs();
+  }
+#else
+  if (nthreads > 1) {
+    fprintf(stderr, "Not compiled with OpenMP, ignoring threads=%zd\n", nthreads);
+  }
+  nthreads = 1;
+#endif
+
+  if (fx % 2 == 0) {
+    fx++;
+    fprintf(stderr, "Filter width must be odd, resetting to %zd\n", fx);
+  }
+  if (fy % 2 == 0) {
+    fy++;
+    fprintf(stderr, "Filter height must be odd, resetting to %zd\n", fy);
+  }
+
+  if (stat(out_path, &sbuf) == 0) {
+    unlink(out_path);
+  }
+
+  if ((API = GMT_Create_Session("make_weights", 0, 0, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't initiate GMT session\n");
+    exit(-1);
+  }
+  setNetCDFLayout(API, nc_chunk, nc_deflate);
+
+  Gregion = readGrid(API, region_path, NULL);
+  if (have_land) {
+    Gland = readGrid(API, land_path, Gregion);
+  }
+  if (have_water) {
+    Gwater = readGrid(API, water_path, Gregion);
+  }
+
+  nx = Gregion->header->n_columns;
+  ny = Gregion->header->n_rows;
+
+  if ((Gout = GMT_Create_Data(API, GMT_IS_GRID, GMT_IS_SURFACE,
+                  GMT_CONTAINER_AND_DATA, NULL,
+                  Gregion->header->wesn, Gregion->header->inc,
+                  Gregion->header->registration, 0, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't create %s\n", out_path);
+    exit(-1);
+  }
+
+  /* The clip mask goes in place of the water mask, if there is one */
+  if (Gwater != NULL) {
+    clip = Gwater->data;
+  } else if ((clip = (float *)malloc(nx * ny * sizeof(float))) == NULL) {
+    fprintf(stderr, "No memory for clip mask\n");
+    exit(-1);
+  }
+  land = Gland ? Gland->data : NULL;
+  for (i = 0; i < nx * ny; i++) {
+    float w = Gwater ? clip[i] : (land ? (float)(1 - (double)land[i]) : 0);
+    clip[i] = (float)((double)w + isRegion(Gregion->data[i])) > 0;
+  }
+
+  if ((work = (float *)malloc(4 * nthreads * nx * sizeof(float))) == NULL) {
+    fprintf(stderr, "No memory for column sums\n");
+    exit(-1);
+  }
+
+#pragma omp parallel for schedule(static, 1) num_threads(nthreads)
+  for (k = 0; k < nthreads; k++) {
+    float *w = work + 4 * k * nx;
+    weightsStrip(Gregion->data, clip, land, Gout->data,
+                 w, w + nx, w + 2 * nx, w + 3 * nx, nx, ny, fx, fy,
+                 k * ny / nthreads, (k + 1) * ny / nthreads,
+                 clip_core, stretch, &ndone);
+  }
+
+  /* Weights run from 0 to 1 */
+  checkOutputRange(out_path, 0, 1);
+  fprintf(stderr, "Writing %s...", out_path);
+  if (GMT_Write_Data(API, GMT_IS_GRID,
+              GMT_IS_FILE, GMT_IS_SURFACE,
+              GMT_CONTAINER_AND_DATA, NULL,
+              out_path, Gout) != 0) {
+    fprintf(stderr, "Couldn't write %s\n", out_path);
+    exit(-1);
+  }
+  fprintf(stderr, "Done.\n");
+
+  GMT_End_IO(API, GMT_IN, 0);
+  GMT_End_IO(API, GMT_OUT, 0);
+  GMT_Destroy_Session(API);
+
+  if (Gwater == NULL) {
+    free(clip);
+  }
+  free(work);
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <gmt.h>
+
+#include "libget.h"
+#include "grdutil.h"
+#include "ncformat.h"
+
+/*
+ * Function getNetCDFLayout reads the optional parameters "chunk" (the
+ * width and height of the chunks, in grid points; 0, the default,
+ * leaves the choice to GMT) and "deflate" (the compression level,
+ * 0 to 9; the default, -1, leaves it to GMT); call it before endpar()
+ */
+void getNetCDFLayout(size_t *chunk, int *deflate) {
+  *chunk = 0;
+  *deflate = -1;
+  getpar("chunk", "z", chunk);
+  getpar("deflate", "d", deflate);
+  if (*deflate > 9) {
+    fprintf(stderr, "deflate must be 0 to 9, not %d\n", *deflate);
+    exit(-1);
+  }
+}
+
+/*
+ * Function setNetCDFLayout sets the GMT defaults so that netCDF grids
+ * written in the session are stored in chunk x chunk tiles,
+ * compressed at level "deflate"; with square chunks of a few
+ * hundred points, reading a region or a point out of a grid only
+ * has to read and uncompress the few chunks that cover it. Grids
+ * written in other formats (e.g., "=bf") aren't affected.
+ */
+void setNetCDFLayout(void *API, size_t chunk, int deflate) {
+  char value[64];
+
+  if (chunk > 0) {
+    snprintf(value, sizeof(value), "%zd/%zd", chunk, chunk);
+    if (GMT_Set_Default(API, "IO_NC4_CHUNK_SIZE", value) != 0) {
+      fprintf(stderr, "Couldn't set the chunk size to %s\n", value);
+      exit(-1);
+    }
+  }
+  if (deflate >= 0) {
+    snprintf(value, sizeof(value), "%d", deflate);
+    if (GMT_Set_Default(API, "IO_NC4_DEFLATION_LEVEL", value) != 0) {
+      fprintf(stderr, "Couldn't set the deflation level to %s\n", value);
+      exit(-1);
+    }
+  }
+}
+
+/*
+ * Function checkOutputRange does nothing unless the grid name "path"
+ * asks GMT to store the grid as scaled 16-bit integers (e.g.,
+ * "global_vs30.grd=ns+s0.0625+o2048+n-32768"; see shortGridFormat);
+ * if it does, it reports the range and the step of the values that
+ * can be stored, and exits with an error if values from z_min to
+ * z_max (the range of the grid, or a bound on it) wouldn't fit.
+ * Each value is stored as the nearest multiple of the step (scale)
+ * from the offset, so it comes back within half a step of what it
+ * was; values that are themselves such multiples (e.g., the whole
+ * numbers used as special Vs30 values, with a step of 1/16) come
+ * back exactly. outputRangeFits does the same check but returns 0
+ * (after the message) rather than exiting, and 1 if the values fit.
+ */
+void checkOutputRange(const char *path, double z_min, double z_max) {
+  if (!outputRangeFits(path, z_min, z_max)) {
+    exit(-1);
+  }
+}
+
+int outputRangeFits(const char *path, double z_min, double z_max) {
+  double scale, offset, lo, hi, t;
+  int nodata;
+
+  if (!shortGridFormat(path, &scale, &offset, &nodata)) {
+    return 1;
+  }
+  lo = offset + scale * (nodata == -32768 ? -32767 : -32768);
+  hi = offset + scale * (nodata == 32767 ? 32766 : 32767);
+  if (lo > hi) {
+    t = lo;
+    lo = hi;
+    hi = t;
+  }
+  fprintf(stderr, "%s holds %g to %g in steps of %g (to within %g)\n",
+          nativeFileName(path), lo, hi, fabs(scale), 0.5 * fabs(scale));
+  if (z_min < lo - 0.5 * fabs(scale) || z_max > hi + 0.5 * fabs(scale)) {
+    fprintf(stderr, "Error: values from %g to %g won't fit in %s; "
+            "change its +s (scale) or +o (offset)\n", z_min, z_max, path);
+    return 0;
+  }
+  return 1;
+}
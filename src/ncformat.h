@@ -0,0 +1,22 @@
+/*
+ *  ncformat.h include file.
+ *
+ *  The layout of the netCDF grids the programs write: the size of
+ *  the chunks (tiles) the grid is stored in and how hard each chunk
+ *  is compressed, set through the "chunk" and "deflate" parameters
+ *  that all of the programs that write grids take; and a check that
+ *  the values going into a grid stored as scaled 16-bit integers
+ *  will fit.
+ */
+
+#ifndef _NCFORMAT_H
+#define _NCFORMAT_H 1
+
+#include <stddef.h>
+
+extern void getNetCDFLayout(size_t *chunk, int *deflate);
+extern void setNetCDFLayout(void *API, size_t chunk, int deflate);
+extern void checkOutputRange(const char *path, double z_min, double z_max);
+extern int  outputRangeFits(const char *path, double z_min, double z_max);
+
+#endif
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <locale.h>
+
+#include <gmt.h>
+
+#include "libget.h"
+#include "grdutil.h"
+#include "ncformat.h"
+
+/*
+ * overviews: make a pyramid of reduced-resolution copies of a grid
+ *
+ * infile is read just once, a row at a time, and "levels" (default 4)
+ * overviews of it are written as it goes: level k reduces blocks of
+ * 2^k by 2^k points of infile (2x2, 4x4, 8x8, ...) to one point.
+ * outfile names them; its "%d" is replaced by the size of the blocks
+ * (e.g., outfile=global_vs30_%dx.grd makes global_vs30_2x.grd,
+ * global_vs30_4x.grd, ...). With method=mean (the default) a block
+ * becomes the mean of its points that aren't NaN, which suits Vs30;
+ * with method=mode it becomes the value that occurs most often in it
+ * (the smallest, if there's a tie), which keeps masks, weights that
+ * are mostly 0 or 1, and special values like the water velocity from
+ * being blurred. A block that is all NaN is NaN.
+ *
+ * The overviews are pixel registered: each point is the footprint of
+ * its block, so they line up with infile whichever way it is
+ * registered. The blocks at the east and south edges are short if
+ * the size of infile isn't a multiple of theirs. The last column of
+ * a gridline-registered grid that goes all the way around the globe
+ * repeats the first, so it is left out. Only the last 2^levels rows
+ * of infile are in memory at a time. "chunk" and "deflate" set the
+ * tiling and compression of netCDF overviews (see ncformat.c).
+ */
+
+#define MAX_LEVELS 12
+
+#define METHOD_MEAN 0
+#define METHOD_MODE 1
+
+/*
+ * Function overviewName returns (in a new string) the output name
+ * template with its "%d" replaced by the block size f
+ */
+char *overviewName(const char *template, size_t f) {
+  const char *p = strstr(template, "%d");
+  char *name;
+  size_t len = strlen(template) + 32;
+
+  if ((name = (char *)malloc(len)) == NULL) {
+    fprintf(stderr, "No memory for file names\n");
+    exit(-1);
+  }
+  snprintf(name, len, "%.*s%zd%s", (int)(p - template), template, f, p + 2);
+  return name;
+}
+
+static int byValue(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*
+ * Function reduceRow makes a row of an overview (nxo points) from
+ * nrows rows of the input (at most f; they are "stride" floats apart
+ * in "rows"), reducing each block of f columns (of the first nx) to
+ * a point; "scratch" must hold f * f floats
+ */
+void reduceRow(const float *rows, size_t nrows, size_t stride, size_t nx,
+               size_t f, int method, float *scratch, float *out,
+               size_t nxo) {
+  size_t io, i, i1, m, n, k, run, best;
+  double sum;
+  float v;
+
+  for (io = 0; io < nxo; io++) {
+    i1 = (io + 1) * f < nx ? (io + 1) * f : nx;
+    n = 0;
+    sum = 0;
+    for (m = 0; m < nrows; m++) {
+      for (i = io * f; i < i1; i++) {
+        v = rows[m * stride + i];
+        if (isnan(v)) {
+          continue;
+        }
+        if (method == METHOD_MEAN) {
+          sum += v;
+        } else {
+          scratch[n] = v;
+        }
+        n++;
+      }
+    }
+    if (n == 0) {
+      out[io] = NAN;
+    } else if (method == METHOD_MEAN) {
+      out[io] = sum / n;
+    } else {
+      qsort(scratch, n, sizeof(float), byValue);
+      out[io] = scratch[0];
+      best = 0;
+      for (k = 0; k < n; k += run) {
+        for (run = 1; k + run < n && scratch[k + run] == scratch[k]; run++)
+          ;
+        if (run > best) {
+          best = run;
+          out[io] = scratch[k];
+        }
+      }
+    }
+  }
+}
+
+int main(int ac, char **av) {
+
+  /* Input file */
+  char in_path[256];
+
+  /* Output files */
+  char out_tmpl[256];
+  char *out_path[MAX_LEVELS];
+
+  char method_str[16] = "mean";
+  int method;
+  size_t levels = 4, k, f, maxf, nx_in, nx, ny, row, r0;
+  size_t nxo[MAX_LEVELS], report;
+  size_t nc_chunk;
+  int nc_deflate;
+  double x0, y0, wesn[4], inc[2];
+  float *ring, *out, *scratch;
+  void *API;
+  struct GMT_GRID *Gin, *Gout[MAX_LEVELS];
+  struct GMT_GRID_HEADER *h;
+  struct stat sbuf;
+
+  setlocale(LC_NUMERIC, "");
+
+  setpar(ac, av);
+  mstpar("infile", "s", in_path);
+  mstpar("outfile", "s", out_tmpl);
+  getpar("levels", "z", &levels);
+  getStringPar("method", method_str, sizeof(method_str));
+  getNetCDFLayout(&nc_chunk, &nc_deflate);
+  endpar();
+
+  if (levels < 1 || levels > MAX_LEVELS) {
+    fprintf(stderr, "levels must be 1 to %d\n", MAX_LEVELS);
+    exit(-1);
+  }
+  if (strcmp(method_str, "mean") == 0) {
+    method = METHOD_MEAN;
+  } else if (strcmp(method_str, "mode") == 0) {
+    method = METHOD_MODE;
+  } else {
+    fprintf(stderr, "Unknown method %s (use mean or mode)\n", method_str);
+    exit(-1);
+  }
+  if (strstr(out_tmpl, "%d") == NULL) {
+    fprintf(stderr, "outfile must have a %%d for the block size\n");
+    exit(-1);
+  }
+  for (k = 0; k < levels; k++) {
+    out_path[k] = overviewName(out_tmpl, (size_t)1 << (k + 1));
+    if (stat(nativeFileName(out_path[k]), &sbuf) == 0) {
+      unlink(nativeFileName(out_path[k]));
+    }
+  }
+
+  if ((API = GMT_Create_Session("overviews", 0, 0, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't initiate GMT session\n");
+    exit(-1);
+  }
+  setNetCDFLayout(API, nc_chunk, nc_deflate);
+
+  if ((Gin = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW, NULL,
+                  in_path, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", in_path);
+    exit(-1);
+  }
+  h = Gin->header;
+  nx_in = nx = h->n_columns;
+  ny = h->n_rows;
+  if (!h->registration &&
+      fabs(h->wesn[GMT_XHI] - h->wesn[GMT_XLO] - 360) < 0.5 * h->inc[GMT_X]) {
+    nx--;
+  }
+
+  /* The footprint of the NW point of infile */
+  x0 = h->wesn[GMT_XLO] + (h->registration ? 0 : -0.5 * h->inc[GMT_X]);
+  y0 = h->wesn[GMT_YHI] - (h->registration ? 0 : -0.5 * h->inc[GMT_Y]);
+
+  /*
+   * Open the overviews; their headers are written before any of the
+   * data, but neither a mean nor a mode can go outside of the range
+   * of infile, so give them that
+   */
+  for (k = 0; k < levels; k++) {
+    f = (size_t)1 << (k + 1);
+    nxo[k] = (nx + f - 1) / f;
+    inc[GMT_X] = f * h->inc[GMT_X];
+    inc[GMT_Y] = f * h->inc[GMT_Y];
+    wesn[GMT_XLO] = x0;
+    wesn[GMT_XHI] = x0 + nxo[k] * inc[GMT_X];
+    wesn[GMT_YHI] = y0;
+    wesn[GMT_YLO] = y0 - ((ny + f - 1) / f) * inc[GMT_Y];
+    if ((Gout[k] = GMT_Create_Data(API, GMT_IS_GRID, GMT_IS_SURFACE,
+                    GMT_CONTAINER_ONLY, NULL, wesn, inc,
+                    GMT_GRID_PIXEL_REG, 0, NULL)) == NULL ||
+        Gout[k]->header->n_columns != nxo[k] ||
+        Gout[k]->header->n_rows != (ny + f - 1) / f) {
+      fprintf(stderr, "Couldn't create %s\n", out_path[k]);
+      exit(-1);
+    }
+    Gout[k]->header->z_min = h->z_min;
+    Gout[k]->header->z_max = h->z_max;
+    checkOutputRange(out_path[k], h->z_min, h->z_max);
+    if (GMT_Write_Data(API, GMT_IS_GRID,
+                GMT_IS_FILE, GMT_IS_SURFACE,
+                GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW, NULL,
+                out_path[k], Gout[k]) != 0) {
+      fprintf(stderr, "Couldn't open %s for writing\n", out_path[k]);
+      exit(-1);
+    }
+  }
+
+  /*
+   * The rows of infile go round a ring of maxf rows; since every
+   * block size divides maxf, the rows of a block are always next to
+   * each other in it
+   */
+  maxf = (size_t)1 << levels;
+  if ((ring = (float *)malloc(maxf * nx_in * sizeof(float))) == NULL ||
+      (out = (float *)malloc(nxo[0] * sizeof(float))) == NULL ||
+      (scratch = (float *)malloc(maxf * maxf * sizeof(float))) == NULL) {
+    fprintf(stderr, "No memory for %zd rows\n", maxf);
+    exit(-1);
+  }
+
+  report = ny / 100 > 0 ? ny / 100 : 1;
+  for (row = 0; row < ny; row++) {
+    if (GMT_Get_Row(API, row, Gin, ring + (row % maxf) * nx_in)) {
+      fprintf(stderr, "Couldn't read row %zd of %s\n", row, in_path);
+      exit(-1);
+    }
+    for (k = 0; k < levels; k++) {
+      f = (size_t)1 << (k + 1);
+      if ((row + 1) % f != 0 && row != ny - 1) {
+        continue;
+      }
+      r0 = row - row % f;
+      reduceRow(ring + (r0 % maxf) * nx_in, row - r0 + 1, nx_in, nx, f,
+                method, scratch, out, nxo[k]);
+      if (GMT_Put_Row(API, row / f, Gout[k], out)) {
+        fprintf(stderr, "Couldn't write row %zd of %s\n", row / f, out_path[k]);
+        exit(-1);
+      }
+    }
+    if ((row + 1) % report == 0) {
+      fprintf(stderr, "Done with %'ld of %'ld elements\n",
+              (row + 1) * nx_in, ny * nx_in);
+    }
+  }
+
+  GMT_End_IO(API, GMT_IN, 0);
+  GMT_End_IO(API, GMT_OUT, 0);
+  GMT_Destroy_Session(API);
+
+  for (k = 0; k < levels; k++) {
+    free(out_path[k]);
+  }
+  free(ring);
+  free(out);
+  free(scratch);
+  return 0;
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gmt.h>
+
+#include "libget.h"
+#include "ncformat.h"
+
+/*
+ * paste_grd: paste overlapping tiles together, west to east
+ *
+ * tile1, tile2, ... are GMT grd files with the same resolution and
+ * the same rows (north and south edges), with their grid points
+ * co-registered, given in order from west to east; each tile must
+ * overlap the next by at least one column. Where two tiles overlap
+ * the western half of the overlap is taken from the western tile
+ * and the eastern half from the eastern one, so if the tiles were
+ * made with an overlap wider than the reach of whatever filter
+ * produced them, the seams are exact. The output, outfile, runs
+ * from the west edge of the first tile to the east edge of the last.
+ * The tiles are read and the output written a row at a time, so
+ * only about two rows of the output are ever in memory. "chunk" and
+ * "deflate" set the tiling and compression of a netCDF outfile (see
+ * ncformat.c).
+ */
+
+#define MAX_TILES 1024
+
+char *mysprint(const char *fmt, int value);
+
+int main(int ac, char **av) {
+
+  /* Input files */
+  char tile[256];
+
+  /* Output file */
+  char out_path[256];
+
+  void *API;
+  struct GMT_GRID *Gtile[MAX_TILES], *Gout;
+  struct GMT_GRID_HEADER *h, *h0;
+  size_t off[MAX_TILES], first[MAX_TILES];
+  size_t ntiles = 0, nx, ny, nbuf = 0, i, k, row, last, nc_chunk;
+  int nc_deflate;
+  double wesn[4], dx;
+  float *buf, *out;
+  struct stat sbuf;
+
+  setpar(ac, av);
+  mstpar("outfile", "s", out_path);
+  getNetCDFLayout(&nc_chunk, &nc_deflate);
+
+  if ((API = GMT_Create_Session("paste_grd", 0, 0, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't initiate GMT session\n");
+    exit(-1);
+  }
+  setNetCDFLayout(API, nc_chunk, nc_deflate);
+
+  /* Open all of the tiles, but only read their headers */
+  while (getpar(mysprint("tile%d", (int)ntiles + 1), "s", tile)) {
+    if (ntiles == MAX_TILES) {
+      fprintf(stderr, "Too many tiles (max %d)\n", MAX_TILES);
+      exit(-1);
+    }
+    if ((Gtile[ntiles] = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW, NULL,
+                  tile, NULL)) == NULL) {
+      fprintf(stderr, "Couldn't read %s\n", tile);
+      exit(-1);
+    }
+    ntiles++;
+  }
+  endpar();
+
+  if (ntiles == 0) {
+    fprintf(stderr, "No tiles given (tile1=...)\n");
+    exit(-1);
+  }
+
+  /*
+   * Work out where each tile starts in the output; the 0.1 is
+   * just to avoid roundoff error
+   */
+  h0 = Gtile[0]->header;
+  dx = h0->inc[0];
+  ny = h0->n_rows;
+  memcpy(wesn, h0->wesn, sizeof(wesn));
+  for (k = 0; k < ntiles; k++) {
+    h = Gtile[k]->header;
+    if (h->n_rows != ny || fabs(h->inc[0] - dx) > 0.001 * dx ||
+        h->wesn[GMT_XLO] < wesn[GMT_XLO] - 0.1 * dx ||
+        fabs(h->wesn[GMT_YLO] - wesn[GMT_YLO]) > 0.1 * h->inc[1] ||
+        fabs(h->wesn[GMT_YHI] - wesn[GMT_YHI]) > 0.1 * h->inc[1]) {
+      fprintf(stderr, "Tile %zd doesn't line up with tile 1\n",
+              k + 1);
+      exit(-1);
+    }
+    off[k] = (size_t)((h->wesn[GMT_XLO] - wesn[GMT_XLO]) / dx + 0.1);
+    if (h->n_columns > nbuf) {
+      nbuf = h->n_columns;
+    }
+  }
+
+  /*
+   * first[k] is the first output column taken from tile k: the
+   * middle of its overlap with tile k - 1
+   */
+  first[0] = 0;
+  for (k = 1; k < ntiles; k++) {
+    last = off[k-1] + Gtile[k-1]->header->n_columns - 1;
+    if (off[k] <= off[k-1] || off[k] > last) {
+      fprintf(stderr, "Tile %zd must overlap tile %zd by at least one column\n",
+              k + 1, k);
+      exit(-1);
+    }
+    first[k] = (off[k] + last + 1) / 2;
+  }
+  h = Gtile[ntiles-1]->header;
+  nx = off[ntiles-1] + h->n_columns;
+  wesn[GMT_XHI] = h->wesn[GMT_XHI];
+
+  if (stat(out_path, &sbuf) == 0) {
+    unlink(out_path);
+  }
+
+  if ((Gout = GMT_Create_Data(API, GMT_IS_GRID, GMT_IS_SURFACE,
+                  GMT_CONTAINER_ONLY, NULL, wesn, h0->inc,
+                  GMT_GRID_NODE_REG, 0, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't create %s\n", out_path);
+    exit(-1);
+  }
+  if (Gout->header->n_columns != nx) {
+    fprintf(stderr, "Tiles don't line up: expected %zd columns, got %d\n",
+            nx, Gout->header->n_columns);
+    exit(-1);
+  }
+
+  /* The header is written first, so give it the range of all the tiles */
+  Gout->header->z_min = h0->z_min;
+  Gout->header->z_max = h0->z_max;
+  for (k = 1; k < ntiles; k++) {
+    h = Gtile[k]->header;
+    if (h->z_min < Gout->header->z_min) {
+      Gout->header->z_min = h->z_min;
+    }
+    if (h->z_max > Gout->header->z_max) {
+      Gout->header->z_max = h->z_max;
+    }
+  }
+  checkOutputRange(out_path, Gout->header->z_min, Gout->header->z_max);
+  if (GMT_Write_Data(API, GMT_IS_GRID,
+              GMT_IS_FILE, GMT_IS_SURFACE,
+              GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW, NULL,
+              out_path, Gout) != 0) {
+    fprintf(stderr, "Couldn't open %s for writing\n", out_path);
+    exit(-1);
+  }
+
+  if ((buf = (float *)malloc((nbuf + nx) * sizeof(float))) == NULL) {
+    fprintf(stderr, "No memory for row buffers\n");
+    exit(-1);
+  }
+  out = buf + nbuf;
+
+  fprintf(stderr, "Pasting %zd tiles into %s...\n", ntiles, out_path);
+  for (row = 0; row < ny; row++) {
+    for (k = 0; k < ntiles; k++) {
+      if (GMT_Get_Row(API, row, Gtile[k], buf)) {
+        fprintf(stderr, "Couldn't read row %zd of tile %zd\n", row, k + 1);
+        exit(-1);
+      }
+      last = k < ntiles - 1 ? first[k+1] : nx;
+      i = first[k] - off[k];
+      memcpy(out + first[k], buf + i, (last - first[k]) * sizeof(float));
+    }
+    if (GMT_Put_Row(API, row, Gout, out)) {
+      fprintf(stderr, "Couldn't write row %zd of %s\n", row, out_path);
+      exit(-1);
+    }
+    if ((row+1) % 100 == 0) {
+      fprintf(stderr, "Done with %zd of %zd rows\n", row+1, ny);
+    }
+  }
+  fprintf(stderr, "Done.\n");
+
+  GMT_End_IO(API, GMT_IN, 0);
+  GMT_End_IO(API, GMT_OUT, 0);
+  GMT_Destroy_Session(API);
+
+  free(buf);
+  return 0;
+}
+
+char *mysprint(const char *fmt, int value) {
+  char *outstr = (char *)malloc(64 * sizeof(char));
+  snprintf(outstr, 64 * sizeof(char), fmt, value);
+  return outstr;
+}
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gmt.h>
+
+#include "libget.h"
+#include "grdutil.h"
+
+/*
+ * sample_grd: sample grids at a list of sites
+ *
+ * "sites" is a text file with a site per line, starting with its
+ * longitude and latitude (anything after them, such as a station
+ * code, is just carried along); grid1, grid2, ... are GMT grd files
+ * that are point for point co-registered with each other (e.g., the
+ * Vs30 map, its uncertainty, and the amplification maps). Each line
+ * of the output, "outfile", is the line of "sites" followed by the
+ * value of each grid at the site, in the order of the sites; a site
+ * that is off the grids gets NaN, and a line that doesn't start
+ * with two numbers is copied through as it is.
+ *
+ * Rather than going to the grids once per site, the sites are sorted
+ * by the tile of the grids they fall in (tiles of "tile_size" by
+ * tile_size grid points, default 512, in row-major order), and each
+ * tile that has any sites in it is read once from each grid (as a
+ * subregion, so only that part of the file is read) and all of its
+ * sites sampled. So the cost grows with the number of tiles the
+ * sites touch rather than with the number of sites.
+ *
+ * "method" is "bilinear" (the default) or "nearest"; bilinear
+ * interpolation leaves out NaN grid points the way GMT does (see
+ * grdutil.c), and longitudes wrap on grids that go around the globe,
+ * as in vs30query.
+ */
+
+#define MAX_GRIDS 64
+
+struct site {
+  double fx, fy;                /* grid coordinates: column, row */
+  size_t tile;                  /* NO_TILE if off the grid */
+  size_t index;                 /* line number in the sites file */
+};
+
+#define NO_TILE ((size_t)-1)
+
+char *mysprint(const char *fmt, int value);
+
+static int byTile(const void *a, const void *b) {
+  const struct site *s = (const struct site *)a, *t = (const struct site *)b;
+
+  if (s->tile != t->tile) return s->tile < t->tile ? -1 : 1;
+  if (s->fy != t->fy) return s->fy < t->fy ? -1 : 1;
+  if (s->fx != t->fx) return s->fx < t->fx ? -1 : 1;
+  return s->index < t->index ? -1 : s->index > t->index;
+}
+
+/*
+ * Function readTile reads grid points c0..c1 of rows r0..r1 of the
+ * grid in path (with header h) as a subregion; exits if it can't
+ */
+struct GMT_GRID *readTile(void *API, const char *path,
+                          const struct GMT_GRID_HEADER *h,
+                          size_t c0, size_t c1, size_t r0, size_t r1) {
+  double wesn[4], half = h->registration ? 0.5 : 0;
+  struct GMT_GRID *G;
+
+  wesn[0] = h->wesn[0] + c0 * h->inc[0];
+  wesn[1] = h->wesn[0] + (c1 + 2 * half) * h->inc[0];
+  wesn[3] = h->wesn[3] - r0 * h->inc[1];
+  wesn[2] = h->wesn[3] - (r1 + 2 * half) * h->inc[1];
+  if ((G = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_AND_DATA, wesn, path, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't read %s\n", path);
+    exit(-1);
+  }
+  if (G->header->n_columns != c1 - c0 + 1 || G->header->n_rows != r1 - r0 + 1) {
+    fprintf(stderr, "Reading columns %zd-%zd, rows %zd-%zd of %s gave %d x %d points\n",
+            c0, c1, r0, r1, path, G->header->n_columns, G->header->n_rows);
+    exit(-1);
+  }
+  return G;
+}
+
+int main(int ac, char **av) {
+
+  /* Input files */
+  char sites_path[256];
+  char grid_path[MAX_GRIDS][256];
+
+  /* Output file */
+  char out_path[256];
+
+  char method[16] = "bilinear";
+  size_t tile_size = 512;
+
+  void *API;
+  struct GMT_GRID *Ghdr[MAX_GRIDS], *G, *Gwrap;
+  struct GMT_GRID_HEADER *h;
+  struct site *S;
+  char **lines, *is_site, buf[4096], *end, *p = NULL;
+  double *value;
+  size_t ngrids = 0, nsites = 0, nlines = 0, cap = 0, ntiles = 0;
+  size_t nx, ny, ncols, ntx, k, m, first, last, tj, ti, r0, r1, c0, c1;
+  size_t i, j, ii, jj, tnx;
+  double x0, y0, lon, lat, tx, ty;
+  int bilin = 1, global = 0, wrap;
+  const float *z, *zw;
+  FILE *fp;
+
+  setpar(ac, av);
+  mstpar("sites", "s", sites_path);
+  mstpar("outfile", "s", out_path);
+  getStringPar("method", method, sizeof(method));
+  getpar("tile_size", "z", &tile_size);
+  while (ngrids < MAX_GRIDS &&
+         getpar(mysprint("grid%d", (int)ngrids + 1), "s", grid_path[ngrids])) {
+    ngrids++;
+  }
+  endpar();
+
+  if (ngrids == 0) {
+    fprintf(stderr, "No grids given (grid1=...)\n");
+    exit(-1);
+  }
+  if (strcmp(method, "nearest") == 0) {
+    bilin = 0;
+  } else if (strcmp(method, "bilinear") != 0) {
+    fprintf(stderr, "Unknown method %s (use bilinear or nearest)\n", method);
+    exit(-1);
+  }
+  if (tile_size == 0) {
+    fprintf(stderr, "tile_size must be greater than 0\n");
+    exit(-1);
+  }
+
+  if ((API = GMT_Create_Session("sample_grd", 0, 0, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't initiate GMT session\n");
+    exit(-1);
+  }
+
+  /* Just the headers for now */
+  for (k = 0; k < ngrids; k++) {
+    if ((Ghdr[k] = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                    GMT_IS_FILE, GMT_IS_SURFACE,
+                    GMT_CONTAINER_ONLY, NULL, grid_path[k], NULL)) == NULL) {
+      fprintf(stderr, "Couldn't read %s\n", grid_path[k]);
+      exit(-1);
+    }
+  }
+  h = Ghdr[0]->header;
+  nx = h->n_columns;
+  ny = h->n_rows;
+  for (k = 1; k < ngrids; k++) {
+    if (Ghdr[k]->header->n_columns != nx || Ghdr[k]->header->n_rows != ny ||
+        Ghdr[k]->header->registration != h->registration ||
+        fabs(Ghdr[k]->header->wesn[0] - h->wesn[0]) > 0.01 * h->inc[0] ||
+        fabs(Ghdr[k]->header->wesn[3] - h->wesn[3]) > 0.01 * h->inc[1]) {
+      fprintf(stderr, "%s is not co-registered with %s\n", grid_path[k],
+              grid_path[0]);
+      exit(-1);
+    }
+  }
+
+  /* Where the grid points are: on the edges, or half a cell in */
+  x0 = h->wesn[0] + (h->registration ? 0.5 * h->inc[0] : 0);
+  y0 = h->wesn[3] - (h->registration ? 0.5 * h->inc[1] : 0);
+  ncols = nx;
+  if (fabs(h->wesn[1] - h->wesn[0] - 360) < 0.5 * h->inc[0]) {
+    global = 1;
+    /* On a gridline grid the last column repeats the first */
+    if (!h->registration) {
+      ncols--;
+    }
+  }
+  ntx = (nx + tile_size - 1) / tile_size;
+
+  /*
+   * Read the sites and work out which tile each one is in: the tile
+   * of the grid point to its upper left (or nearest to it)
+   */
+  if ((fp = fopen(sites_path, "r")) == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", sites_path);
+    exit(-1);
+  }
+  lines = NULL;
+  is_site = NULL;
+  S = NULL;
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    if (nlines == cap) {
+      cap = cap == 0 ? 1024 : 2 * cap;
+      if ((lines = (char **)realloc(lines, cap * sizeof(char *))) == NULL ||
+          (is_site = (char *)realloc(is_site, cap)) == NULL ||
+          (S = (struct site *)realloc(S, cap * sizeof(struct site))) == NULL) {
+        fprintf(stderr, "No memory for %zd sites\n", cap);
+        exit(-1);
+      }
+    }
+    if ((lines[nlines] = strdup(buf)) == NULL) {
+      fprintf(stderr, "No memory for %zd sites\n", cap);
+      exit(-1);
+    }
+    is_site[nlines] = 0;
+    lon = strtod(buf, &end);
+    if (end != buf) {
+      lat = strtod(p = end, &end);
+    }
+    if (end == buf || end == p || (*end != '\0' && !isspace(*end))) {
+      nlines++;                 /* not a site; copied to the output */
+      continue;
+    }
+    is_site[nlines] = 1;
+    if (global) {
+      lon = x0 + fmod(fmod(lon - x0, 360) + 360, 360);
+    }
+    S[nsites].fx = (lon - x0) / h->inc[0];
+    S[nsites].fy = (y0 - lat) / h->inc[1];
+    S[nsites].index = nlines;
+    S[nsites].tile = NO_TILE;
+
+    /* Allow for roundoff at the edges */
+    if (S[nsites].fx < 0 && S[nsites].fx > -1e-6) S[nsites].fx = 0;
+    if (S[nsites].fy < 0 && S[nsites].fy > -1e-6) S[nsites].fy = 0;
+    if (S[nsites].fy > ny - 1 && S[nsites].fy < ny - 1 + 1e-6) S[nsites].fy = ny - 1;
+    if (!global && S[nsites].fx > ncols - 1 && S[nsites].fx < ncols - 1 + 1e-6) {
+      S[nsites].fx = ncols - 1;
+    }
+    if (S[nsites].fy >= 0 && S[nsites].fy <= ny - 1 && S[nsites].fx >= 0 &&
+        (global ? S[nsites].fx < ncols : S[nsites].fx <= ncols - 1)) {
+      if (bilin) {
+        i = (size_t)S[nsites].fx;
+        j = (size_t)S[nsites].fy;
+      } else {
+        i = (size_t)(S[nsites].fx + 0.5);
+        j = (size_t)(S[nsites].fy + 0.5);
+        if (i >= nx) {
+          i = 0;                /* the east edge of a global grid */
+        }
+      }
+      S[nsites].tile = (j / tile_size) * ntx + i / tile_size;
+    }
+    nsites++;
+    nlines++;
+  }
+  fclose(fp);
+
+  if ((value = (double *)malloc((nlines > 0 ? nlines : 1) * ngrids * sizeof(double))) == NULL) {
+    fprintf(stderr, "No memory for the values at %zd sites\n", nsites);
+    exit(-1);
+  }
+  for (m = 0; m < nlines * ngrids; m++) {
+    value[m] = NAN;
+  }
+
+  qsort(S, nsites, sizeof(struct site), byTile);
+
+  /*
+   * Go through the tiles in order; each takes in the row and column
+   * past its end too, for the interpolation
+   */
+  for (first = 0; first < nsites && S[first].tile != NO_TILE; first = last) {
+    for (last = first + 1; last < nsites && S[last].tile == S[first].tile; last++);
+    ntiles++;
+    tj = S[first].tile / ntx;
+    ti = S[first].tile % ntx;
+    r0 = tj * tile_size;
+    r1 = r0 + tile_size < ny - 1 ? r0 + tile_size : ny - 1;
+    c0 = ti * tile_size;
+    c1 = c0 + tile_size < nx - 1 ? c0 + tile_size : nx - 1;
+    tnx = c1 - c0 + 1;
+
+    /* Only a pixel grid around the globe wraps past its last column */
+    wrap = 0;
+    for (m = first; bilin && m < last; m++) {
+      if ((size_t)S[m].fx == nx - 1 && S[m].fx > nx - 1) {
+        wrap = 1;
+      }
+    }
+
+    for (k = 0; k < ngrids; k++) {
+      G = readTile(API, grid_path[k], Ghdr[k]->header, c0, c1, r0, r1);
+      Gwrap = wrap ? readTile(API, grid_path[k], Ghdr[k]->header, 0, 0, r0, r1) : NULL;
+      z = G->data;
+      zw = Gwrap == NULL ? NULL : Gwrap->data;
+      for (m = first; m < last; m++) {
+        if (!bilin) {
+          i = (size_t)(S[m].fx + 0.5);
+          j = (size_t)(S[m].fy + 0.5);
+          if (i >= nx) {
+            i = 0;
+          }
+          value[S[m].index * ngrids + k] = z[(j - r0) * tnx + i - c0];
+          continue;
+        }
+        /* As in vs30query, neighbors with no weight point back here */
+        i = (size_t)S[m].fx;
+        j = (size_t)S[m].fy;
+        tx = S[m].fx - i;
+        ty = S[m].fy - j;
+        ii = tx == 0 ? i : i + 1;
+        jj = ty == 0 ? j : j + 1;
+        if (ii == nx) {
+          value[S[m].index * ngrids + k] =
+            bilinear(z[(j - r0) * tnx + i - c0], zw[j - r0],
+                     z[(jj - r0) * tnx + i - c0], zw[jj - r0], tx, ty);
+        } else {
+          value[S[m].index * ngrids + k] =
+            bilinear(z[(j - r0) * tnx + i - c0], z[(j - r0) * tnx + ii - c0],
+                     z[(jj - r0) * tnx + i - c0], z[(jj - r0) * tnx + ii - c0],
+                     tx, ty);
+        }
+      }
+      GMT_Destroy_Data(API, &G);
+      if (Gwrap != NULL) {
+        GMT_Destroy_Data(API, &Gwrap);
+      }
+    }
+  }
+  fprintf(stderr, "Sampled %zd grids at %zd sites (%zd of them on the grids) "
+          "in %zd tiles\n", ngrids, nsites, first, ntiles);
+
+  if ((fp = fopen(out_path, "w")) == NULL) {
+    fprintf(stderr, "Couldn't open %s for writing\n", out_path);
+    exit(-1);
+  }
+  for (m = 0; m < nlines; m++) {
+    fputs(lines[m], fp);
+    if (is_site[m]) {
+      for (k = 0; k < ngrids; k++) {
+        fprintf(fp, " %.7g", value[m * ngrids + k]);
+      }
+    }
+    fputc('\n', fp);
+    free(lines[m]);
+  }
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Couldn't write %s\n", out_path);
+    exit(-1);
+  }
+
+  for (k = 0; k < ngrids; k++) {
+    GMT_Destroy_Data(API, &Ghdr[k]);
+  }
+  GMT_Destroy_Session(API);
+
+  free(lines);
+  free(is_site);
+  free(value);
+  free(S);
+  return 0;
+}
+
+char *mysprint(const char *fmt, int value) {
+  char *outstr = (char *)malloc(64 * sizeof(char));
+  snprintf(outstr, 64 * sizeof(char), fmt, value);
+  return outstr;
+}
@@ -5,10 +5,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <gmt.h>
 
 #include "libget.h"
+#include "ncformat.h"
 
 /*
  * This program reads a binary grid of dimension nx by ny and runs
@@ -37,7 +42,667 @@
  * It's possible for roundoff error to accumulate using this method
  * but it doesn't seem to be a problem.
  *
+ * With threads=N (N > 1) the output grid is split into N horizontal
+ * strips, each filtered by its own thread. A strip starts by priming
+ * its own column sums from the (fy / 2) rows above and below its 
+ * first row, so the strips are independent of one another; the 
+ * result matches the single-threaded filter except for the order in
+ * which the floating point sums are accumulated (with one thread it
+ * is identical).
+ *
+ * With engine=separable the same filter is done in two passes, 
+ * because the average over the box is the average over its rows of
+ * the averages along each row. The first pass replaces each row of 
+ * the input with its running horizontal average (in place, a row at
+ * a time); the second runs the vertical sums down the grid in blocks
+ * of SEP_BLOCK columns, so that the column sums for a block and the 
+ * pieces of the rows being added and dropped all stay in cache, 
+ * rather than streaming the full width of the grid through it for
+ * every output row as the scanline engine does. The results differ
+ * from the scanline engine only by roundoff, and don't depend on
+ * the number of threads.
+ *
+ * With reprime=K (K > 0) the running sums are thrown away every K
+ * steps and recomputed from scratch, adding up the points in double
+ * precision, so the roundoff that builds up in them can't carry over
+ * more than K steps (without it a sum running down 16,800 rows of a
+ * 7.5c grid has 16,800 chances to pick up error). A new sum costs 
+ * about as much as a filter's width of steps, so K of a few times 
+ * the filter size keeps the cost down. That is done for the column
+ * sums of the scanline engine, every K rows; the running sums along 
+ * the rows, and the sums for a block of columns in the separable
+ * engine, are small enough that with reprime set they are simply 
+ * kept in double precision the whole way. With verify=N the
+ * program checks N points of the output (chosen at random) against
+ * the average of the input over the same box computed directly in
+ * double precision, reports the largest difference as a fraction of
+ * the largest magnitude in the box (so one tolerance serves grids of
+ * slopes and grids of elevations), and exits with an error if it's
+ * bigger than tolerance.
+ *
+ * With nan=1 NaNs in the input are skipped rather than spreading to
+ * every output point whose box they fall in: alongside each running
+ * sum the filter keeps a running count of the valid points, and the
+ * output is the sum divided by the count (NaN where the box holds no
+ * valid points at all). With weightfile=<grid> each point is weighted
+ * by the value of that grid (which must match the input in size), and
+ * the output is the weighted average, sum(w * z) / sum(w), over the
+ * box, again skipping NaNs (the count is just the case of w = 1).
+ * Points whose weight is zero or NaN are skipped too, and the output
+ * is NaN where the weights in the box add up to (nearly) zero, so the
+ * weights should be of order one (e.g., a 0/1 or fractional mask).
+ * These modes keep their sums in double and use the scanline engine.
+ *
+ * With periodic_x=1 the grid is taken to go all the way around the
+ * globe, and instead of rolling in and out at the west and east edges
+ * the filter is always full width, its running row sums wrapping
+ * around from one edge to the other. On a gridline-registered grid
+ * the first and last columns are the same meridian, so the last
+ * column of the output is then a copy of the first; on a pixel-
+ * registered grid every column is distinct.
+ *
+ * Instead of fx and fy (in grid points) the filter's half-width and
+ * half-height can be given in kilometers, as fx_km and fy_km. fy_km
+ * sets a fixed fy, but since the meridians close in toward the poles
+ * fx_km gives each row its own fx, the odd number of grid points that
+ * comes closest to 2 * fx_km kilometers at that row's latitude (on a
+ * sphere of the authalic radius; near the poles, no wider than the
+ * grid). The box for an output point is fx wide for its own row in
+ * every row it covers, so the filter still costs the same for every
+ * point however wide it gets. It uses the scanline engine.
+ *
+ * With filter=gauss the output approximates a Gaussian filter rather
+ * than a boxcar, by running the boxcar over the grid several times 
+ * (passes=3 or 4, default 3; each pass is the convolution of the 
+ * last with a box, which quickly tends to a Gaussian). fx and fy are
+ * then the full widths of the Gaussian, taken to be six standard
+ * deviations, as in GMT's grdfilter -Fg; the box widths for the 
+ * passes are the odd numbers that together give the same variance
+ * (following W. Wells, 1986, "Efficient synthesis of Gaussian filters
+ * by cascaded uniform filters", IEEE PAMI 8(2)). Each pass costs the
+ * same as a boxcar, whatever the widths. It can be used with either
+ * engine, nan=1, and periodic_x, but not with fx_km, weightfile, or 
+ * verify.
+ *
+ * With decimate=D (D > 1) only every D-th row and column of the 
+ * filtered grid (starting with the first) is written out, so the 
+ * output has 1/D the resolution of the input and the same north and
+ * west edges (the south and east edges move in if the grid's size 
+ * less one isn't a multiple of D). The output otherwise has the 
+ * registration of infile; a decimated pixel-registered grid is 
+ * written gridline registered, on the centers of the pixels kept.
+ *
+ * "chunk" and "deflate" lay out a netCDF outfile in compressed
+ * tiles (see ncformat.c).
+ *
+ */
+
+/* Number of columns in each block of the separable vertical pass */
+#define SEP_BLOCK 2048
+
+/* Recompute the running sums from scratch every reprime steps (0 = never) */
+static size_t reprime = 0;
+
+/*
+ * Number of distinct columns around the globe for periodic_x (the 
+ * grid's width, less the repeated column if it is gridline
+ * registered), or 0 if not periodic
+ */
+static size_t period = 0;
+
+/* The fx for each row, when they vary with latitude (fx_km), or NULL */
+static size_t *row_fx = NULL;
+
+/* Most boxcar passes for filter=gauss */
+#define MAX_PASSES 4
+
+/* Authalic radius of the Earth, in kilometers */
+#define EARTH_RADIUS_KM 6371.0072
+
+/* Total weight below which a weighted box is treated as empty */
+#define MIN_WEIGHT 1e-6
+
+/*
+ * Function sumRows sets sum[i] to the sum of rows first_row through
+ * last_row of "in" in columns i0 through i0 + n - 1, accumulating
+ * in double (in exact[], n doubles) so that the only error in the 
+ * result is its final rounding to float
+ */
+void sumRows(const float *in, float *sum, double *exact, size_t nx, 
+             size_t i0, size_t n, size_t first_row, size_t last_row) {
+  size_t i, j;
+  const float *row;
+
+  memset((void *)exact, 0, n * sizeof(double));
+  for (j = first_row; j <= last_row; j++) {
+    row = in + j * nx + i0;
+    for (i = 0; i < n; i++) {
+      exact[i] += row[i];
+    }
+  }
+  for (i = 0; i < n; i++) {
+    sum[i] = exact[i];
+  }
+}
+
+/*
+ * Function filterRowT computes one row of output, out, from the
+ * column sums (each the sum of n_rows points) by running the
+ * boxcar across the row, rolling in and out at the edges. The row
+ * sum is kept in double if exact is set, or float otherwise; this is
+ * inlined into filterRow with exact constant, so each case gets its
+ * own loop with only its own sum in it
+ */
+#define ROW_SUM_ADD(x) if (exact) exact_sum += (x); else row_sum += (x)
+
+static inline __attribute__((always_inline)) 
+void filterRowT(const float *col_sum, float *out, size_t nx, size_t fx,
+                size_t n_rows, const int exact) {
+  size_t i, first_col, last_col, n_cols;
+  float row_sum;
+  double exact_sum;
+
+  row_sum = 0;
+  exact_sum = 0;
+
+  /*
+   * If the grid wraps around the globe the filter is always fx wide,
+   * and the columns it drops and adds wrap around from one edge to 
+   * the other; for the first point it runs from fx/2 columns before
+   * the end of the row to fx/2 columns into it
+   */
+  if (period > 0) {
+    first_col = (period - fx / 2) % period;
+    last_col  = fx / 2;
+    for (i = 0; i < fx; i++) {
+      ROW_SUM_ADD(col_sum[(first_col + i) % period]);
+    }
+    for (i = 0; i < period; i++) {
+      if (exact) {
+        out[i] = exact_sum / (n_rows * fx);
+      } else {
+        out[i] = row_sum / (n_rows * fx);
+      }
+      ROW_SUM_ADD(-col_sum[first_col]);
+      if (++first_col == period) {
+        first_col = 0;
+      }
+      if (++last_col == period) {
+        last_col = 0;
+      }
+      ROW_SUM_ADD(col_sum[last_col]);
+    }
+    if (period < nx) {
+      out[period] = out[0];
+    }
+    return;
+  }
+
+  first_col = 0;
+  last_col  = fx / 2; /* Again, works because arrays are 0 offset */
+  n_cols = last_col - first_col + 1;
+
+  /* Prime the pump with the first fx/2 + 1 columns */
+  for (i = first_col; i <= last_col; i++) {
+     ROW_SUM_ADD(col_sum[i]);
+  }
+
+  /* Step through each column of the row of the output */
+  for (i = 0; i < nx; i++) {
+    /* compute the average of the points in the filter */
+    if (exact) {
+      out[i] = exact_sum / (n_rows * n_cols);
+    } else {
+      out[i] = row_sum / (n_rows * n_cols);
+    }
+    /* 
+     * Now move the filter one point to the right.
+     */
+    /*
+     * don't start dropping colunms from the left until we're 
+     * done rolling in 
+     */
+    if (last_col >= (fx - 1)) {	
+      ROW_SUM_ADD(-col_sum[first_col]);  
+      first_col++;
+    }
+    /*
+     * Add columns to the right until we start rolling out
+     */
+    if (last_col < (nx - 1)) {
+      last_col++;
+      ROW_SUM_ADD(col_sum[last_col]);
+    }
+    n_cols = last_col - first_col + 1;
+  }
+}
+
+/*
+ * Function filterRow runs filterRowT with the row sum kept in 
+ * double if reprime is set, or in float otherwise
+ */
+void filterRow(const float *col_sum, float *out, size_t nx, size_t fx,
+               size_t n_rows) {
+  if (reprime > 0) {
+    filterRowT(col_sum, out, nx, fx, n_rows, 1);
+  } else {
+    filterRowT(col_sum, out, nx, fx, n_rows, 0);
+  }
+}
+
+/*
+ * Function filterStrip computes output rows j0 through j1 - 1 of
+ * the nx by ny grid "in" into "out", using col_sum (nx floats) as 
+ * its workspace (and exact, nx doubles, if reprime is set). ndone 
+ * counts finished rows across all of the strips for the progress 
+ * reports.
+ */
+void filterStrip(const float *in, float *out, float *col_sum, double *exact,
+                 size_t nx, size_t ny, size_t fx, size_t fy,
+                 size_t j0, size_t j1, size_t *ndone) {
+  size_t i, j, done;
+  size_t first_row, last_row, n_rows;
+  const float *row;
+
+  memset((void *)col_sum, 0, nx * sizeof(float));
+
+  /* 
+   * Prep the strip; the filter for row j0 covers rows j0 - fy/2
+   * through j0 + fy/2, less whatever falls off the top or bottom 
+   * of the grid (at the top of the grid we're rolling in, so that 
+   * is rows 0 through fy/2)
+   */
+  first_row = j0 > fy / 2 ? j0 - fy / 2 : 0;
+  last_row  = j0 + fy / 2 < ny - 1 ? j0 + fy / 2 : ny - 1;
+
+  /* Prime the pump with those rows; note the <= in the for loop */
+  if (reprime > 0) {
+    sumRows(in, col_sum, exact, nx, 0, nx, first_row, last_row);
+  } else {
+    for (j = first_row; j <= last_row; j++) {
+      row = in + j * nx;
+      for (i = 0; i < nx; i++) {
+        col_sum[i] += row[i];
+      }
+    }
+  }
+  n_rows = last_row - first_row + 1;
+
+  /* Now step through the strip of the output grid by row... */
+  for (j = j0; j < j1; j++) {
+    filterRow(col_sum, out + j * nx, nx, row_fx ? row_fx[j] : fx, n_rows);
+
+    /*
+     * Shift down one row
+     */
+    /*
+     * Don't start dropping rows from the top until we're 
+     * done rolling in.
+     */
+    if (j >= fy / 2) {	
+      row = in + first_row * nx;
+      for (i = 0; i < nx; i++) {
+        col_sum[i] -= row[i];
+      }
+      first_row++;
+    }
+    /*
+     * Add rows to the bottom until we start rolling out
+     */
+    if (last_row < (ny - 1)) {
+      last_row++;
+      row = in + last_row * nx;
+      for (i = 0; i < nx; i++) {
+        col_sum[i] += row[i];
+      }
+    }
+    n_rows = last_row - first_row + 1;
+    if (reprime > 0 && (j + 1 - j0) % reprime == 0) {
+      sumRows(in, col_sum, exact, nx, 0, nx, first_row, last_row);
+    }
+
+#pragma omp atomic capture
+    done = ++(*ndone);
+    if (done % 100 == 0) {
+      fprintf(stderr, "Done with %ld of %ld rows\n", done, ny);
+    }
+  }
+}
+
+/*
+ * Function addWeighted adds (sign = 1) or drops (sign = -1) the
+ * valid points of row "row" (and their weights, from "wt", or 1 if 
+ * wt is NULL) to or from the column sums
+ */
+static inline void addWeighted(const float *row, const float *wt, 
+                               double *col_sum, double *col_wt, 
+                               size_t nx, double sign) {
+  size_t i;
+  double w;
+
+  for (i = 0; i < nx; i++) {
+    w = wt ? wt[i] : 1;
+    if (isnan(row[i]) || isnan(w) || w == 0) {
+      continue;
+    }
+    col_sum[i] += sign * w * row[i];
+    col_wt[i]  += sign * w;
+  }
+}
+
+/*
+ * Function filterRowWeighted is filterRow for the weighted (or 
+ * NaN-skipping) filter: it runs the weighted column sums and total
+ * weights across the row and divides one by the other
+ */
+void filterRowWeighted(const double *col_sum, const double *col_wt, 
+                       float *out, size_t nx, size_t fx) {
+  size_t i, first_col, last_col;
+  double row_sum, row_wt;
+
+  first_col = 0;
+  last_col  = fx / 2;
+
+  row_sum = 0;
+  row_wt = 0;
+
+  /* Wrap around the globe as filterRowT does */
+  if (period > 0) {
+    first_col = (period - fx / 2) % period;
+    for (i = 0; i < fx; i++) {
+      row_sum += col_sum[(first_col + i) % period];
+      row_wt  += col_wt[(first_col + i) % period];
+    }
+    for (i = 0; i < period; i++) {
+      out[i] = row_wt > MIN_WEIGHT ? row_sum / row_wt : NAN;
+      row_sum -= col_sum[first_col];
+      row_wt  -= col_wt[first_col];
+      if (++first_col == period) {
+        first_col = 0;
+      }
+      if (++last_col == period) {
+        last_col = 0;
+      }
+      row_sum += col_sum[last_col];
+      row_wt  += col_wt[last_col];
+    }
+    if (period < nx) {
+      out[period] = out[0];
+    }
+    return;
+  }
+
+  for (i = first_col; i <= last_col; i++) {
+     row_sum += col_sum[i];
+     row_wt  += col_wt[i];
+  }
+
+  for (i = 0; i < nx; i++) {
+    out[i] = row_wt > MIN_WEIGHT ? row_sum / row_wt : NAN;
+    if (last_col >= (fx - 1)) {	
+      row_sum -= col_sum[first_col];
+      row_wt  -= col_wt[first_col];
+      first_col++;
+    }
+    if (last_col < (nx - 1)) {
+      last_col++;
+      row_sum += col_sum[last_col];
+      row_wt  += col_wt[last_col];
+    }
+  }
+}
+
+/*
+ * Function filterStripWeighted is filterStrip for the weighted (or
+ * NaN-skipping) filter; wt is the weight grid (NULL for all ones),
+ * and col_sum and col_wt each need nx doubles
+ */
+void filterStripWeighted(const float *in, const float *wt, float *out, 
+                         double *col_sum, double *col_wt,
+                         size_t nx, size_t ny, size_t fx, size_t fy,
+                         size_t j0, size_t j1, size_t *ndone) {
+  size_t j, done;
+  size_t first_row, last_row;
+
+  memset((void *)col_sum, 0, nx * sizeof(double));
+  memset((void *)col_wt, 0, nx * sizeof(double));
+
+  first_row = j0 > fy / 2 ? j0 - fy / 2 : 0;
+  last_row  = j0 + fy / 2 < ny - 1 ? j0 + fy / 2 : ny - 1;
+  for (j = first_row; j <= last_row; j++) {
+    addWeighted(in + j * nx, wt ? wt + j * nx : NULL, col_sum, col_wt, nx, 1);
+  }
+
+  for (j = j0; j < j1; j++) {
+    filterRowWeighted(col_sum, col_wt, out + j * nx, nx, 
+                      row_fx ? row_fx[j] : fx);
+    if (j >= fy / 2) {	
+      addWeighted(in + first_row * nx, wt ? wt + first_row * nx : NULL, 
+                  col_sum, col_wt, nx, -1);
+      first_row++;
+    }
+    if (last_row < (ny - 1)) {
+      last_row++;
+      addWeighted(in + last_row * nx, wt ? wt + last_row * nx : NULL, 
+                  col_sum, col_wt, nx, 1);
+    }
+
+#pragma omp atomic capture
+    done = ++(*ndone);
+    if (done % 100 == 0) {
+      fprintf(stderr, "Done with %ld of %ld rows\n", done, ny);
+    }
+  }
+}
+
+/*
+ * Function filterRowsInPlace replaces each row of the nx by ny grid
+ * "grid" with its running horizontal average (the first pass of the
+ * separable engine); row_buf holds a copy of the row for each thread
  */
+void filterRowsInPlace(float *grid, float *row_buf, size_t nx, size_t ny,
+                       size_t fx, size_t nthreads) {
+  size_t j;
+
+#pragma omp parallel for schedule(static) num_threads(nthreads)
+  for (j = 0; j < ny; j++) {
+    float *buf = row_buf;
+#ifdef _OPENMP
+    buf += omp_get_thread_num() * nx;
+#endif
+    memcpy(buf, grid + j * nx, nx * sizeof(float));
+    filterRow(buf, grid + j * nx, nx, fx, 1);
+  }
+}
+
+/*
+ * Function filterColumnsT runs the vertical boxcar down columns i0
+ * through i1 - 1 of "in" into "out" (the second pass of the separable
+ * engine), rolling in and out at the top and bottom just as 
+ * filterStrip does. The sums for the block are kept in col_sum
+ * (i1 - i0 floats) or, if exact is set, in exact_sum (as many 
+ * doubles); a block's worth of sums is small enough to stay in cache
+ * either way, so the doubles cost little and need no repriming
+ */
+#define COL_SUM_ADD(i, x) \
+  if (exact) exact_sum[i] += (x); else col_sum[i] += (x)
+
+static inline __attribute__((always_inline))
+void filterColumnsT(const float *in, float *out, float *col_sum, 
+                    double *exact_sum, size_t nx, size_t ny, size_t fy, 
+                    size_t i0, size_t i1, const int exact) {
+  size_t i, j, n = i1 - i0;
+  size_t first_row, last_row, n_rows;
+  const float *row, *top, *bot;
+  float *orow;
+
+  if (exact) {
+    memset((void *)exact_sum, 0, n * sizeof(double));
+  } else {
+    memset((void *)col_sum, 0, n * sizeof(float));
+  }
+
+  first_row = 0;
+  last_row  = fy / 2 < ny - 1 ? fy / 2 : ny - 1;
+  for (j = first_row; j <= last_row; j++) {
+    row = in + j * nx + i0;
+    for (i = 0; i < n; i++) {
+      COL_SUM_ADD(i, row[i]);
+    }
+  }
+  n_rows = last_row - first_row + 1;
+
+  /*
+   * Each step down writes a row of the block and then drops the top
+   * row and adds the bottom one, in a single sweep over the block
+   */
+  for (j = 0; j < ny; j++) {
+    orow = out + j * nx + i0;
+    top = j >= fy / 2 ? in + first_row * nx + i0 : NULL;
+    bot = last_row < (ny - 1) ? in + (last_row + 1) * nx + i0 : NULL;
+    if (top && bot) {
+      for (i = 0; i < n; i++) {
+        if (exact) {
+          orow[i] = exact_sum[i] / n_rows;
+          exact_sum[i] += (double)bot[i] - top[i];
+        } else {
+          orow[i] = col_sum[i] / n_rows;
+          col_sum[i] += bot[i] - top[i];
+        }
+      }
+    } else {
+      for (i = 0; i < n; i++) {
+        orow[i] = exact ? exact_sum[i] / n_rows : col_sum[i] / n_rows;
+        if (top) {
+          COL_SUM_ADD(i, -top[i]);
+        }
+        if (bot) {
+          COL_SUM_ADD(i, bot[i]);
+        }
+      }
+    }
+    if (top) {
+      first_row++;
+    }
+    if (bot) {
+      last_row++;
+    }
+    n_rows = last_row - first_row + 1;
+  }
+}
+
+/*
+ * Function filterColumns runs filterColumnsT with the sums in 
+ * double (in exact, which needs i1 - i0 doubles) if it's given, 
+ * or in float (in col_sum) otherwise
+ */
+void filterColumns(const float *in, float *out, float *col_sum, double *exact,
+                   size_t nx, size_t ny, size_t fy, size_t i0, size_t i1) {
+  if (exact) {
+    filterColumnsT(in, out, col_sum, exact, nx, ny, fy, i0, i1, 1);
+  } else {
+    filterColumnsT(in, out, col_sum, exact, nx, ny, fy, i0, i1, 0);
+  }
+}
+
+/*
+ * Function gaussBoxes fills widths[0..npass-1] with the odd box 
+ * widths whose boxcars, run one after the other, give the variance
+ * of a Gaussian of full width "width" (six standard deviations): 
+ * the first m passes use the odd width just under the ideal one and
+ * the rest the odd width just above it, with m picked to make the
+ * variances add up (Wells, 1986)
+ */
+void gaussBoxes(size_t width, size_t npass, size_t *widths) {
+  double sigma2, ideal;
+  long wl, m;
+  size_t k;
+
+  sigma2 = (width / 6.0) * (width / 6.0);
+  ideal = sqrt(12 * sigma2 / npass + 1);
+  wl = (long)ideal;
+  if (wl % 2 == 0) {
+    wl--;
+  }
+  m = lround((12 * sigma2 - npass * wl * wl - 4.0 * npass * wl - 3.0 * npass) /
+             (-4.0 * wl - 4));
+  for (k = 0; k < npass; k++) {
+    widths[k] = (long)k < m ? wl : wl + 2;
+  }
+}
+
+/*
+ * Function verifyOutput compares npoints randomly chosen points of
+ * the filtered grid "out" with the average of "in" over the same 
+ * (rolled in or out) box, computed by brute force in double, and 
+ * returns the largest difference divided by the largest magnitude 
+ * of the input in the box; if weighted is set the
+ * average is the weighted, NaN-skipping one (with weights wt, or
+ * all ones if wt is NULL), and a NaN where one is expected counts
+ * as no error (anywhere else, as an infinite one)
+ */
+double verifyOutput(const float *in, const float *wt, const float *out, 
+                    size_t nx, size_t ny, size_t fx, size_t fy, 
+                    size_t npoints, int weighted) {
+  size_t i, j, ii, jj, kk, n, i0, i1, j0, j1;
+  double sum, sum_wt, w, avg, err, scale, max_err = 0;
+
+  srand(1);
+  for (n = 0; n < npoints; n++) {
+    i = (size_t)rand() % nx;
+    j = (size_t)rand() % ny;
+    if (row_fx) {
+      fx = row_fx[j];
+    }
+    if (period > 0) {
+      /* ii runs past the ends of the row and wraps around */
+      i0 = i % period + period - fx / 2;
+      i1 = i % period + period + fx / 2;
+    } else {
+      i0 = i > fx / 2 ? i - fx / 2 : 0;
+      i1 = i + fx / 2 < nx - 1 ? i + fx / 2 : nx - 1;
+    }
+    j0 = j > fy / 2 ? j - fy / 2 : 0;
+    j1 = j + fy / 2 < ny - 1 ? j + fy / 2 : ny - 1;
+    sum = 0;
+    sum_wt = 0;
+    scale = 0;
+    for (jj = j0; jj <= j1; jj++) {
+      for (ii = i0; ii <= i1; ii++) {
+        kk = jj * nx + (period > 0 ? ii % period : ii);
+        if (fabs(in[kk]) > scale) {
+          scale = fabs(in[kk]);
+        }
+        if (weighted) {
+          w = wt ? wt[kk] : 1;
+          if (isnan(in[kk]) || isnan(w) || w == 0) {
+            continue;
+          }
+          sum += w * in[kk];
+          sum_wt += w;
+        } else {
+          sum += in[kk];
+          sum_wt += 1;
+        }
+      }
+    }
+    avg = weighted && sum_wt <= MIN_WEIGHT ? NAN : sum / sum_wt;
+    if (isnan(avg) && isnan(out[j * nx + i])) {
+      continue;
+    }
+    err = fabs(out[j * nx + i] - avg);
+    if (scale > 0) {
+      err /= scale;
+    }
+    if (isnan(err)) {
+      err = INFINITY;
+    }
+    if (err > max_err) {
+      max_err = err;
+    }
+  }
+  return max_err;
+}
 
 int main(int ac, char **av) {
 
@@ -55,27 +720,129 @@ int main(int ac, char **av) {
   size_t nx;
   size_t ny;
 
-  float **rows, *col_sum, *out, row_sum;
-  size_t i, j;
-  size_t first_row, last_row, first_col, last_col;
-  size_t n_rows, n_cols, first_row_ix, last_row_ix;
+  /* Optional weight grid for the weighted average */
+  char wt_path[256];
+
+  /* Skip NaNs (nan=1), and/or weight the points (weightfile) */
+  int nan_aware = 0, have_wt, weighted;
+
+  /* Wrap around in longitude (periodic_x=1) */
+  int periodic_x = 0;
+
+  /* Half-width and half-height of the filter in km, if given */
+  float fx_km, fy_km;
+  int have_fx_km, have_fy_km;
+  double lat, width;
+  size_t j, fx_max, fx_min;
+
+  /* Which filter engine to use: "scanline" or "separable" */
+  char engine[64] = "scanline";
+  int separable;
+
+  /* Boxcar or Gaussian filter, and the box sizes for each pass */
+  char filter[64] = "boxcar";
+  size_t p, npass = 1, pass_fx[MAX_PASSES], pass_fy[MAX_PASSES];
+  int have_passes;
+  float *src, *dst, *tmp;
+
+  /* Write only every decimate-th row and column */
+  size_t decimate = 1, nx_out, ny_out, i, jd;
+  double wesn_out[4], inc_out[2], half;
+  struct GMT_GRID *Gdec = NULL;
+
+  /* Number of output points to check (0 = don't), and how closely */
+  size_t verify = 0;
+  float tolerance = 1e-5;
+  double max_err;
+
+  float *col_sum;
+  double *exact = NULL, *wsums = NULL;
+  size_t k, nblocks, nthreads = 1, ndone = 0, nc_chunk;
+  int nc_deflate;
+  struct timespec t0, t1;
   void *API; 
-  struct GMT_GRID *Gin, *Gout;
+  struct GMT_GRID *Gin, *Gout, *Gwt = NULL;
   struct stat sbuf;
   int err;
 
   setpar(ac, av);
   mstpar("infile", "s", in_path);
   mstpar("outfile", "s", out_path);
-  mstpar("fx", "z", &fx);
-  mstpar("fy", "z", &fy);
+  if (!(have_fx_km = getpar("fx_km", "f", &fx_km))) {
+    mstpar("fx", "z", &fx);
+  }
+  if (!(have_fy_km = getpar("fy_km", "f", &fy_km))) {
+    mstpar("fy", "z", &fy);
+  }
+  getpar("threads", "z", &nthreads);
+  getpar("engine", "s", engine);
+  getpar("reprime", "z", &reprime);
+  getpar("verify", "z", &verify);
+  getpar("tolerance", "f", &tolerance);
+  getpar("nan", "d", &nan_aware);
+  getpar("periodic_x", "d", &periodic_x);
+  getpar("filter", "s", filter);
+  have_passes = getpar("passes", "z", &npass);
+  getpar("decimate", "z", &decimate);
+  have_wt = getpar("weightfile", "s", wt_path);
+  weighted = have_wt || nan_aware;
+  getNetCDFLayout(&nc_chunk, &nc_deflate);
   endpar();
 
-  if (fx % 2 == 0) {
+  if (strcmp(engine, "scanline") == 0) {
+    separable = 0;
+  } else if (strcmp(engine, "separable") == 0) {
+    separable = 1;
+  } else {
+    fprintf(stderr, "Unknown engine '%s' (use scanline or separable)\n", engine);
+    exit(-1);
+  }
+  if (weighted && separable) {
+    fprintf(stderr, "nan and weightfile need engine=scanline\n");
+    exit(-1);
+  }
+  if (have_fx_km && separable) {
+    fprintf(stderr, "fx_km needs engine=scanline\n");
+    exit(-1);
+  }
+  if (strcmp(filter, "gauss") == 0) {
+    if (!have_passes) {
+      npass = 3;
+    }
+    if (npass < 3 || npass > MAX_PASSES) {
+      fprintf(stderr, "passes must be 3 or 4\n");
+      exit(-1);
+    }
+    if (have_fx_km || have_wt || verify > 0) {
+      fprintf(stderr, "filter=gauss can't be used with fx_km, weightfile, or verify\n");
+      exit(-1);
+    }
+  } else if (strcmp(filter, "boxcar") == 0) {
+    npass = 1;
+  } else {
+    fprintf(stderr, "Unknown filter '%s' (use boxcar or gauss)\n", filter);
+    exit(-1);
+  }
+  if (decimate == 0) {
+    decimate = 1;
+  }
+
+#ifdef _OPENMP
+  if (nthreads == 0) {
+    nthreads = omp_get_num_procs();
+  }
+#else
+  if (nthreads > 1) {
+    fprintf(stderr, "Not compiled with OpenMP, ignoring threads=%zd\n", nthreads);
+  }
+  nthreads = 1;
+#endif
+
+  if (npass == 1 && !have_fx_km && fx % 2 == 0) {
     fx++;
     fprintf(stderr, "Filter width must be odd, resetting to %zd\n", fx);
   }
-  if (fy % 2 == 0) {
+  if (npass == 1 && !have_fy_km && fy % 2 == 0) {
     fy++;
     fprintf(stderr, "Filter height must be odd, resetting to %zd\n", fy);
   }
@@ -88,6 +855,7 @@ int main(int ac, char **av) {
     fprintf(stderr, "Couldn't initiate GMT session\n");
     exit(-1);
   }
+  setNetCDFLayout(API, nc_chunk, nc_deflate);
 
   /* Initialize the input object and open the file */
   fprintf(stderr, "Reading %s...", in_path);
@@ -99,6 +867,25 @@ int main(int ac, char **av) {
     exit(-1);
   }
   fprintf(stderr, "Done.\n");
+
+  /* Averages of the input can't go outside of its range */
+  checkOutputRange(out_path, Gin->header->z_min, Gin->header->z_max);
+  if (have_wt) {
+    fprintf(stderr, "Reading %s...", wt_path);
+    if ((Gwt = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_AND_DATA, NULL,
+                  wt_path, NULL)) == NULL) {
+      fprintf(stderr, "Couldn't read %s\n", wt_path);
+      exit(-1);
+    }
+    fprintf(stderr, "Done.\n");
+    if (Gwt->header->n_columns != Gin->header->n_columns ||
+        Gwt->header->n_rows != Gin->header->n_rows) {
+      fprintf(stderr, "%s and %s aren't the same size\n", wt_path, in_path);
+      exit(-1);
+    }
+  }
   /* 
    * The output file has the same dimensions as the input 
    * so write the header, prep the output object, then open
@@ -107,7 +894,7 @@ int main(int ac, char **av) {
   if ((Gout = GMT_Create_Data(API, GMT_IS_GRID, GMT_IS_SURFACE,
 				  GMT_CONTAINER_AND_DATA, NULL,
 				  Gin->header->wesn, Gin->header->inc,
-				  GMT_GRID_NODE_REG, 0, NULL)) == NULL) {
+				  Gin->header->registration, 0, NULL)) == NULL) {
     fprintf(stderr, "Couldn't create %s\n", out_path);
     exit(-1);
   }
@@ -116,133 +903,224 @@ int main(int ac, char **av) {
   nx = Gin->header->n_columns;
   ny = Gin->header->n_rows;
 
+  if (periodic_x) {
+    if (fabs(Gin->header->wesn[GMT_XHI] - Gin->header->wesn[GMT_XLO] - 360) >
+        0.5 * Gin->header->inc[GMT_X]) {
+      fprintf(stderr, "periodic_x needs a grid that spans 360 degrees of longitude\n");
+      exit(-1);
+    }
+    period = Gin->header->registration ? nx : nx - 1;
+  }
+
+  /*
+   * Turn kilometers into grid points; a row's fx can't be more than
+   * the widest odd number that fits in the grid (or around the globe)
+   */
+  if (have_fy_km) {
+    fy = 2 * (size_t)(fy_km / 
+         (EARTH_RADIUS_KM * Gin->header->inc[GMT_Y] * M_PI / 180) + 0.5) + 1;
+  }
+  if (have_fx_km) {
+    fx_max = period > 0 ? period : nx - 1;
+    if (fx_max % 2 == 0) {
+      fx_max--;
+    }
+    if ((row_fx = (size_t *)malloc(ny * sizeof(size_t))) == NULL) {
+      fprintf(stderr, "No memory for row_fx\n");
+      exit(-1);
+    }
+    fx = 0;
+    fx_min = fx_max;
+
+    /* On a pixel grid the rows are at the pixel centers */
+    half = Gin->header->registration ? 0.5 : 0;
+    for (j = 0; j < ny; j++) {
+      lat = Gin->header->wesn[GMT_YHI] - (j + half) * Gin->header->inc[GMT_Y];
+      width = fx_km / (EARTH_RADIUS_KM * cos(lat * M_PI / 180) *
+                       Gin->header->inc[GMT_X] * M_PI / 180);
+      row_fx[j] = width < fx_max / 2 ? 2 * (size_t)(width + 0.5) + 1 : fx_max;
+      if (row_fx[j] > fx) {
+        fx = row_fx[j];
+      }
+      if (row_fx[j] < fx_min) {
+        fx_min = row_fx[j];
+      }
+    }
+    fprintf(stderr, "Filter width varies from %zd to %zd points with latitude\n",
+            fx_min, fx);
+  }
+
+  /*
+   * Work out the box sizes for the passes of the Gaussian; the last
+   * pass has the biggest box, and that's the one that has to fit
+   */
+  if (npass > 1) {
+    gaussBoxes(fx, npass, pass_fx);
+    gaussBoxes(fy, npass, pass_fy);
+    fprintf(stderr, "Gaussian %zd x %zd: %zd passes of boxes from %zd x %zd to %zd x %zd\n",
+            fx, fy, npass, pass_fx[0], pass_fy[0], pass_fx[npass-1], pass_fy[npass-1]);
+    fx = pass_fx[npass-1];
+    fy = pass_fy[npass-1];
+  } else {
+    pass_fx[0] = fx;
+    pass_fy[0] = fy;
+  }
+
   if (nx <= fx || ny <= fy) {
     fprintf(stderr, "Grid dimensions %zd x %zd smaller than filter dimensions %zd x %zd\n", 
             nx, ny, fx, fy);
     exit(-1);
   }
 
-  /* Allocate space for fy arrays of floats */
-  if ((rows = (float **)malloc(ny * sizeof(float*))) == NULL) {
-    fprintf(stderr, "No memory for rows\n");
-    exit(-1);
-  }
   /* 
    * col_sum will hold the sums of all nx columns, each of which is the
    * height of the current filter (nominally fy points, but less during
-   * roll in and roll out); zap it because it will be summed into.
+   * roll in and roll out); each strip needs its own. The separable
+   * engine uses it for a row buffer per thread, then for the sums of
+   * one block of columns per thread.
    */
-  if ((col_sum = (float *)malloc(nx * sizeof(float))) == NULL) {
+  if (nthreads > ny) {
+    nthreads = ny;
+  }
+  if ((col_sum = (float *)malloc(nthreads * nx * sizeof(float))) == NULL) {
     fprintf(stderr, "No memory for col_sum\n");
     exit(-1);
   }
-  memset((void *)col_sum, 0, nx * sizeof(float));
+  if (reprime > 0 &&
+      (exact = (double *)malloc(nthreads * nx * sizeof(double))) == NULL) {
+    fprintf(stderr, "No memory for reprime\n");
+    exit(-1);
+  }
+  /* The weighted filter keeps its sums and weights in double */
+  if (weighted &&
+      (wsums = (double *)malloc(2 * nthreads * nx * sizeof(double))) == NULL) {
+    fprintf(stderr, "No memory for the weighted sums\n");
+    exit(-1);
+  }
 
-  /* 
-   * Prep the system; we're rolling in in both x and y, so they
-   * start at 1/2 the ultimate filter width and height
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  /*
+   * Each pass filters src into dst; for the Gaussian the two then
+   * trade places, so the input grid gets used as scratch space
    */
-  first_row = 0;
-  last_row  = fy / 2; /* works without the +1 because arrays are 0 offset */
-
-  /* Prime the pump with the first fy/2+1 rows; note the <= in the for loop */
-  for (j = first_row; j <= last_row; j++) {
-    rows[j] = Gin->data + j * nx;
-    for (i = 0; i < nx; i++) {
-      col_sum[i] += rows[j][i];
+  src = Gin->data;
+  dst = Gout->data;
+  for (p = 0; p < npass; p++) {
+    if (p > 0) {
+      tmp = src;
+      src = dst;
+      dst = tmp;
+      ndone = 0;
+      fprintf(stderr, "Pass %zd of %zd...\n", p + 1, npass);
     }
-  }
-  n_rows = last_row - first_row + 1;
-
-  /* Now step through the output grid (nx * ny) first by row... */
-  for (j = 0; j < ny; j++) {
-    first_col = 0;
-    last_col  = fx / 2; /* Again, works because arrays are 0 offset */
-    n_cols = last_col - first_col + 1;
-
-    /* Prime the pump with the first fx/2 + 1 columns */
-    row_sum = 0;
-    for (i = first_col; i <= last_col; i++) {
-       row_sum += col_sum[i];
+    if (separable) {
+      /* The input isn't needed after this, so it holds the first pass */
+      fprintf(stderr, "Filtering rows...");
+      filterRowsInPlace(src, col_sum, nx, ny, pass_fx[p], nthreads);
+      fprintf(stderr, "Done.\nFiltering columns...");
+      nblocks = (nx + SEP_BLOCK - 1) / SEP_BLOCK;
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+      for (k = 0; k < nblocks; k++) {
+        float *cs = col_sum;
+        double *ex = exact;
+#ifdef _OPENMP
+        cs += omp_get_thread_num() * nx;
+        ex += exact ? omp_get_thread_num() * nx : 0;
+#endif
+        filterColumns(src, dst, cs, ex, nx, ny, pass_fy[p],
+                      k * SEP_BLOCK, (k + 1) * SEP_BLOCK < nx ? (k + 1) * SEP_BLOCK : nx);
+      }
+      fprintf(stderr, "Done.\n");
+    } else if (weighted) {
+#pragma omp parallel for schedule(static, 1) num_threads(nthreads)
+      for (k = 0; k < nthreads; k++) {
+        filterStripWeighted(src, Gwt ? Gwt->data : NULL, dst,
+                            wsums + 2 * k * nx, wsums + (2 * k + 1) * nx,
+                            nx, ny, pass_fx[p], pass_fy[p],
+                            k * ny / nthreads, (k + 1) * ny / nthreads, &ndone);
+      }
+    } else {
+#pragma omp parallel for schedule(static, 1) num_threads(nthreads)
+      for (k = 0; k < nthreads; k++) {
+        filterStrip(src, dst, col_sum + k * nx, 
+                    exact ? exact + k * nx : NULL, nx, ny, pass_fx[p], pass_fy[p],
+                    k * ny / nthreads, (k + 1) * ny / nthreads, &ndone);
+      }
     }
+  }
+  if (dst != Gout->data) {
+    memcpy(Gout->data, dst, nx * ny * sizeof(float));
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  fprintf(stderr, "Filtered %zd x %zd grid with the %s engine in %.3f s\n",
+          nx, ny, engine, 
+          (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec));
 
-    /* Step through each column of the jth row of the output */
-	out = Gout->data + j * nx;
-    for (i = 0; i < nx; i++) {
-      /* compute the average of the points in the filter */
-      out[i] = row_sum / (n_rows * n_cols);
-      /* 
-       * Now move the filter one point to the right.
-       */
-      /*
-       * don't start dropping colunms from the left until we're 
-       * done rolling in 
-       */
-      if (last_col >= (fx - 1)) {	
-        row_sum -= col_sum[first_col];  
-        first_col++;
-      }
-      /*
-       * Add columns to the right until we start rolling out
-       */
-      if (last_col < (nx - 1)) {
-        last_col++;
-        row_sum += col_sum[last_col];
-      }
-      n_cols = last_col - first_col + 1;
+  /* Pick out every decimate-th row and column for the output */
+  if (decimate > 1) {
+    nx_out = (nx - 1) / decimate + 1;
+    ny_out = (ny - 1) / decimate + 1;
+    /* The points kept are where they were (the centers of the pixels) */
+    half = Gin->header->registration ? 0.5 : 0;
+    wesn_out[GMT_XLO] = Gin->header->wesn[GMT_XLO] + half * Gin->header->inc[GMT_X];
+    wesn_out[GMT_XHI] = wesn_out[GMT_XLO] + 
+                        (nx_out - 1) * decimate * Gin->header->inc[GMT_X];
+    wesn_out[GMT_YHI] = Gin->header->wesn[GMT_YHI] - half * Gin->header->inc[GMT_Y];
+    wesn_out[GMT_YLO] = wesn_out[GMT_YHI] - 
+                        (ny_out - 1) * decimate * Gin->header->inc[GMT_Y];
+    inc_out[GMT_X] = decimate * Gin->header->inc[GMT_X];
+    inc_out[GMT_Y] = decimate * Gin->header->inc[GMT_Y];
+    if ((Gdec = GMT_Create_Data(API, GMT_IS_GRID, GMT_IS_SURFACE,
+                    GMT_CONTAINER_AND_DATA, NULL, wesn_out, inc_out,
+                    GMT_GRID_NODE_REG, 0, NULL)) == NULL ||
+        Gdec->header->n_columns != nx_out || Gdec->header->n_rows != ny_out) {
+      fprintf(stderr, "Couldn't create the decimated %s\n", out_path);
+      exit(-1);
     }
-    /*
-     * Shift down one row
-     */
-    /*
-     * Don't start dropping rows from the top until we're 
-     * done rolling in.
-     */
-    if (last_row >= (fy - 1)) {	
-      /*
-       * We only made "rows" with fy elements (which is all we need to
-       * keep on hand), so we just keep rotating through them with 
-       * the % operator here with the first element and in the next 
-       * block with the last.
-       */
-      first_row_ix = first_row % fy;
-      for (i = 0; i < nx; i++) {
-        col_sum[i] -= rows[first_row_ix][i];
-      }
-      first_row++;
-    }
-    /*
-     * Add rows to the bottom until we start rolling out
-     */
-    if (last_row < (ny - 1)) {
-      last_row++;
-      last_row_ix = last_row % fy;
-      rows[last_row_ix] = Gin->data + last_row * nx;
-      for (i = 0; i < nx; i++) {
-        col_sum[i] += rows[last_row_ix][i];
+    for (jd = 0; jd < ny_out; jd++) {
+      for (i = 0; i < nx_out; i++) {
+        Gdec->data[jd * nx_out + i] = Gout->data[jd * decimate * nx + i * decimate];
       }
     }
-    n_rows = last_row - first_row + 1;
-    if ((j+1) % 100 == 0) {
-      fprintf(stderr, "Done with %ld of %ld rows\n", j+1, ny);
-    }
   }
 
   fprintf(stderr, "Writing %s...", out_path);
   if (GMT_Write_Data(API, GMT_IS_GRID,
 			  GMT_IS_FILE, GMT_IS_SURFACE,
 		      GMT_CONTAINER_AND_DATA, NULL,
-		      out_path, Gout) != 0) {
+		      out_path, Gdec ? Gdec : Gout) != 0) {
     fprintf(stderr, "Couldn't write %s\n", out_path);
     exit(-1);
   }
   fprintf(stderr, "Done.\n");
 
+  /* The separable engine overwrites the input, so read it again */
+  if (verify > 0) {
+    GMT_Destroy_Data(API, &Gin);
+    if ((Gin = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_AND_DATA, NULL,
+                  in_path, NULL)) == NULL) {
+      fprintf(stderr, "Couldn't read %s\n", in_path);
+      exit(-1);
+    }
+    max_err = verifyOutput(Gin->data, Gwt ? Gwt->data : NULL, Gout->data,
+                           nx, ny, fx, fy, verify, weighted);
+    fprintf(stderr, "Largest relative error at %zd points: %g (tolerance %g)\n",
+            verify, max_err, tolerance);
+    if (max_err > tolerance) {
+      fprintf(stderr, "Verification failed\n");
+      exit(-1);
+    }
+  }
+
   GMT_End_IO(API, GMT_IN, 0);
   GMT_End_IO(API, GMT_OUT, 0);
   GMT_Destroy_Session(API);
 
   free(col_sum);
-  free(rows);
+  free(exact);
+  free(wsums);
+  free(row_fx);
   return 0;
 }
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <locale.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <gmt.h>
+
+#include "libget.h"
+#include "ncformat.h"
+
+/*
+ * vs30amp: compute linear site amplification from Vs30
+ *
+ * vs30_file is a GMT grd file of Vs30; coef_file is a text table of
+ * the amplification coefficients, one row per period (see
+ * Amplification/amp_coefs.txt):
+ *
+ *   period c_active Vc Vref c_stable V1 V2
+ *
+ * where "period" is a label (e.g., "1.0" or "PGA") and '#' starts a
+ * comment. For each period the amplification of active crustal
+ * regions (Seyhan and Stewart, 2014) is
+ *
+ *   ln(F) = c_active * ln(min(Vs30, Vc) / Vref)
+ *
+ * and that of stable cratonic regions (Stewart et al., 2017) is
+ *
+ *   ln(F) = c_stable * ln(V1 / Vref)                      Vs30 <= V1
+ *           c_stable * ln(Vs30 / Vref)                    V1 < Vs30 <= V2
+ *           c_stable * (ln(V2 / Vref) + ln(Vs30 / V2) / 2)  Vs30 > V2
+ *
+ * "periods" is a comma-separated list of the labels of the periods
+ * to compute (default: every row of coef_file). The outputs are
+ * named by "active_out", "stable_out", and (if "region_file", a grid
+ * that is 1 in stable regions and 0 in active ones, is given)
+ * "combo_out", the active amplification where region_file is 0 plus
+ * region_file times the stable amplification. Any of the outputs
+ * may be left out; a "%s" in the name is replaced by the period
+ * label, and is required if there is more than one period. Vs30 is
+ * read just once for all of the periods and outputs, and its
+ * logarithm taken once per point.
+ *
+ * As in grad2vs30, "band_rows" (default 0) reads the inputs and
+ * writes the outputs that many rows at a time rather than holding
+ * the whole grids in memory, and "threads" (default 1; 0 means one
+ * per processor) splits the rows across worker threads; neither
+ * changes the output. "chunk" and "deflate" apply to all of the
+ * outputs that are netCDF (see ncformat.c).
+ */
+
+#define MAX_PERIODS 64
+
+enum { ACTIVE, STABLE, COMBO, NOUT };
+
+struct coefs {
+  char label[32];
+  double c_active, Vc, Vref, c_stable, V1, V2;
+  /* The logarithms the computation actually uses */
+  double lnVc, lnVref, lnV1, lnV2;
+};
+
+/*
+ * Function readCoefs reads the rows of coef_path whose labels are
+ * in the comma-separated list "periods" (or all of them if periods
+ * is empty) into C, in the order of the list; returns the number
+ * of periods. Exits with a message on error.
+ */
+size_t readCoefs(const char *coef_path, char *periods, struct coefs *C) {
+  struct coefs table[MAX_PERIODS], *t;
+  char line[1024], *p, *label;
+  size_t nrows = 0, n = 0, k;
+  FILE *fp;
+
+  if ((fp = fopen(coef_path, "r")) == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", coef_path);
+    exit(-1);
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if ((p = strchr(line, '#')) != NULL) {
+      *p = '\0';
+    }
+    if (strspn(line, " \t\r\n") == strlen(line)) {
+      continue;
+    }
+    if (nrows == MAX_PERIODS) {
+      fprintf(stderr, "Too many periods in %s (max %d)\n", coef_path, MAX_PERIODS);
+      exit(-1);
+    }
+    t = table + nrows;
+    if (sscanf(line, "%31s %lf %lf %lf %lf %lf %lf", t->label, &t->c_active,
+               &t->Vc, &t->Vref, &t->c_stable, &t->V1, &t->V2) != 7 ||
+        t->Vc <= 0 || t->Vref <= 0 || t->V1 <= 0 || t->V2 < t->V1) {
+      fprintf(stderr, "Bad line in %s: %s", coef_path, line);
+      exit(-1);
+    }
+    t->lnVc = log(t->Vc);
+    t->lnVref = log(t->Vref);
+    t->lnV1 = log(t->V1);
+    t->lnV2 = log(t->V2);
+    nrows++;
+  }
+  fclose(fp);
+
+  if (*periods == '\0') {
+    memcpy(C, table, nrows * sizeof(*C));
+    return nrows;
+  }
+  for (label = strtok(periods, ","); label != NULL; label = strtok(NULL, ",")) {
+    for (k = 0; k < nrows; k++) {
+      if (strcmp(table[k].label, label) == 0) {
+        break;
+      }
+    }
+    if (k == nrows) {
+      fprintf(stderr, "Period %s isn't in %s\n", label, coef_path);
+      exit(-1);
+    }
+    if (n == MAX_PERIODS) {
+      fprintf(stderr, "Too many periods (max %d)\n", MAX_PERIODS);
+      exit(-1);
+    }
+    C[n++] = table[k];
+  }
+  return n;
+}
+
+/*
+ * Function outName returns (in a new string) the output name
+ * template with its "%s" replaced by label
+ */
+char *outName(const char *template, const char *label) {
+  const char *p = strstr(template, "%s");
+  char *name;
+  size_t len;
+
+  if (p == NULL) {
+    return strdup(template);
+  }
+  len = strlen(template) + strlen(label);
+  if ((name = (char *)malloc(len)) == NULL) {
+    fprintf(stderr, "No memory for file names\n");
+    exit(-1);
+  }
+  snprintf(name, len, "%.*s%s%s", (int)(p - template), template, label, p + 2);
+  return name;
+}
+
+/*
+ * The amplification as a function of ln(Vs30); both are monotonic,
+ * which is what lets main() work out the range of the output
+ * before any of it is computed
+ */
+static inline double activeAmp(const struct coefs *C, double lnv) {
+  return exp(C->c_active * ((lnv > C->lnVc ? C->lnVc : lnv) - C->lnVref));
+}
+
+static inline double stableAmp(const struct coefs *C, double lnv) {
+  double lnc = lnv < C->lnV1 ? C->lnV1 : lnv > C->lnV2 ? C->lnV2 : lnv;
+  double above = lnv > C->lnV2 ? 0.5 * (lnv - C->lnV2) : 0;
+
+  return exp(C->c_stable * (lnc - C->lnVref + above));
+}
+
+/*
+ * Function ampBand computes the outputs for nrows rows of nx points
+ * for each of the nper periods; out[p][k] is the band of output k
+ * (ACTIVE, STABLE, or COMBO; NULL if it isn't wanted) for period p,
+ * and region is NULL unless COMBO is wanted. lnv is room for a row
+ * of ln(Vs30) for each thread. The workers share a single count of
+ * finished rows (ndone, out of total) so progress is reported for
+ * the grid as a whole every "report" rows.
+ */
+void ampBand(const struct coefs *C, size_t nper, const float *vs30,
+             const float *region, float *out[][NOUT], double *lnv,
+             size_t nrows, size_t nx, size_t nthreads, size_t *ndone,
+             size_t total, size_t report) {
+  size_t m;
+
+#pragma omp parallel for schedule(dynamic, 16) num_threads(nthreads)
+  for (m = 0; m < nrows; m++) {
+    const float *v = vs30 + m * nx;
+    const float *w = region == NULL ? NULL : region + m * nx;
+    double *lnrow = lnv;
+    double fa, fs;
+    size_t i, p, done;
+    float *oa, *os, *oc;
+
+#ifdef _OPENMP
+    lnrow += omp_get_thread_num() * nx;
+#endif
+    for (i = 0; i < nx; i++) {
+      lnrow[i] = log((double)v[i]);
+    }
+    for (p = 0; p < nper; p++) {
+      oa = out[p][ACTIVE] == NULL ? NULL : out[p][ACTIVE] + m * nx;
+      os = out[p][STABLE] == NULL ? NULL : out[p][STABLE] + m * nx;
+      oc = out[p][COMBO] == NULL ? NULL : out[p][COMBO] + m * nx;
+      for (i = 0; i < nx; i++) {
+        fa = activeAmp(C + p, lnrow[i]);
+        fs = stableAmp(C + p, lnrow[i]);
+        if (oa != NULL) oa[i] = fa;
+        if (os != NULL) os[i] = fs;
+        if (oc != NULL) oc[i] = (w[i] == 0 ? fa : 0) + w[i] * fs;
+      }
+    }
+
+#pragma omp atomic capture
+    done = ++(*ndone);
+    if (done % report == 0) {
+      fprintf(stderr,"Done with %'ld of %'ld elements\n", done * nx, total * nx);
+    }
+  }
+}
+
+int main(int ac, char **av) {
+
+  /* Input files */
+  char vs30_path[256];
+  char region_path[256] = "";
+  char coef_path[256];
+
+  /* Output file name templates */
+  char out_tmpl[NOUT][256] = { "", "", "" };
+  const char *out_par[NOUT] = { "active_out", "stable_out", "combo_out" };
+
+  char periods[1024] = "";
+  struct coefs C[MAX_PERIODS];
+  char *out_path[MAX_PERIODS][NOUT];
+  float *out[MAX_PERIODS][NOUT];
+  size_t nper, nout = 0, p, k, m;
+  size_t nx, ny;
+  size_t ndone = 0, report;
+  size_t nthreads = 1, nc_chunk;
+  int nc_deflate;
+  size_t band_rows = 0, row, nrows;
+  double lo, hi, fa[2], fs[2], wlo, whi;
+  float *vs30, *region = NULL;
+  double *lnv;
+  unsigned int mode;
+  void *API = NULL;
+  struct GMT_GRID *Gvs30, *Gregion = NULL, *Gout[MAX_PERIODS][NOUT];
+  struct GMT_GRID_HEADER *G_hdr;
+  struct stat sbuf;
+
+  setlocale(LC_NUMERIC, "");
+
+  setpar(ac, av);
+  mstpar("vs30_file", "s", vs30_path);
+  mstpar("coef_file", "s", coef_path);
+  getpar("periods", "s", periods);
+  getpar("region_file", "s", region_path);
+  for (k = 0; k < NOUT; k++) {
+    getpar((char *)out_par[k], "s", out_tmpl[k]);
+  }
+  getpar("threads", "z", &nthreads);
+  getpar("band_rows", "z", &band_rows);
+  getNetCDFLayout(&nc_chunk, &nc_deflate);
+  endpar();
+
+#ifdef _OPENMP
+  if (nthreads == 0) {
+    nthreads = omp_get_num_procs();
+  }
+#else
+  if (nthreads > 1) {
+    fprintf(stderr, "Not compiled with OpenMP, ignoring threads=%zd\n", nthreads);
+  }
+  nthreads = 1;
+#endif
+
+  nper = readCoefs(coef_path, periods, C);
+  if (nper == 0) {
+    fprintf(stderr, "No periods in %s\n", coef_path);
+    exit(-1);
+  }
+  if (*out_tmpl[COMBO] != '\0' && *region_path == '\0') {
+    fprintf(stderr, "combo_out needs region_file\n");
+    exit(-1);
+  }
+  for (k = 0; k < NOUT; k++) {
+    if (*out_tmpl[k] == '\0') {
+      continue;
+    }
+    if (nper > 1 && strstr(out_tmpl[k], "%s") == NULL) {
+      fprintf(stderr, "%s needs a %%s for the period with more than one period\n",
+              out_par[k]);
+      exit(-1);
+    }
+    nout++;
+  }
+  if (nout == 0) {
+    fprintf(stderr, "No outputs: give active_out, stable_out, or combo_out\n");
+    exit(-1);
+  }
+  for (p = 0; p < nper; p++) {
+    for (k = 0; k < NOUT; k++) {
+      out_path[p][k] = *out_tmpl[k] == '\0' ? NULL : outName(out_tmpl[k], C[p].label);
+      if (out_path[p][k] != NULL && stat(out_path[p][k], &sbuf) == 0) {
+        unlink(out_path[p][k]);
+      }
+    }
+  }
+
+  API = GMT_Create_Session("vs30amp", 0, 0, NULL);
+  setNetCDFLayout(API, nc_chunk, nc_deflate);
+
+  if (band_rows == 0) {
+    fprintf(stderr, "Reading input files...");
+    mode = GMT_CONTAINER_AND_DATA;
+  } else {
+    fprintf(stderr, "Opening input files...");
+    mode = GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW;
+  }
+  if ((Gvs30 = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  mode, NULL, vs30_path, NULL)) == NULL) {
+    fprintf(stderr, "Couldn't read %s\n", vs30_path);
+    exit(-1);
+  }
+  G_hdr = Gvs30->header;
+  nx = G_hdr->n_columns;
+  ny = G_hdr->n_rows;
+  if (*out_tmpl[COMBO] != '\0') {
+    if ((Gregion = (struct GMT_GRID *)GMT_Read_Data(API, GMT_IS_GRID,
+                    GMT_IS_FILE, GMT_IS_SURFACE,
+                    mode, NULL, region_path, NULL)) == NULL) {
+      fprintf(stderr, "Couldn't read %s\n", region_path);
+      exit(-1);
+    }
+    if (Gregion->header->n_columns != nx || Gregion->header->n_rows != ny) {
+      fprintf(stderr, "Input grids must all be the same size\n");
+      exit(-1);
+    }
+  }
+  fprintf(stderr, "Done.\n");
+
+  /*
+   * Create the outputs. In band mode the headers are written before
+   * any of the data, so give them the range the amplification takes
+   * over the range of Vs30 in its header (it is monotonic in Vs30);
+   * for the combination that is only a bound. In full mode the
+   * range is checked once the outputs have been computed.
+   */
+  for (p = 0; p < nper; p++) {
+    fa[0] = activeAmp(C + p, log(G_hdr->z_min));
+    fa[1] = activeAmp(C + p, log(G_hdr->z_max));
+    fs[0] = stableAmp(C + p, log(G_hdr->z_min));
+    fs[1] = stableAmp(C + p, log(G_hdr->z_max));
+    for (k = 0; k < NOUT; k++) {
+      if (out_path[p][k] == NULL) {
+        Gout[p][k] = NULL;
+        continue;
+      }
+      if ((Gout[p][k] = GMT_Create_Data(API, GMT_IS_GRID, GMT_IS_SURFACE,
+                    band_rows == 0 ? GMT_CONTAINER_AND_DATA : GMT_CONTAINER_ONLY,
+                    NULL, G_hdr->wesn, G_hdr->inc,
+                    G_hdr->registration, 0, NULL)) == NULL) {
+        fprintf(stderr, "Couldn't create %s\n", out_path[p][k]);
+        exit(-1);
+      }
+      if (band_rows == 0) {
+        continue;
+      }
+      if (k == ACTIVE) {
+        lo = fmin(fa[0], fa[1]);
+        hi = fmax(fa[0], fa[1]);
+      } else if (k == STABLE) {
+        lo = fmin(fs[0], fs[1]);
+        hi = fmax(fs[0], fs[1]);
+      } else {
+        wlo = fmax(Gregion->header->z_min, 0);
+        whi = Gregion->header->z_max;
+        lo = wlo * fmin(fs[0], fs[1]);
+        hi = whi * fmax(fs[0], fs[1]);
+        if (wlo == 0) {
+          lo = fmin(lo, fmin(fa[0], fa[1]));
+          hi = fmax(hi, fmax(fa[0], fa[1]));
+        }
+      }
+      Gout[p][k]->header->z_min = lo;
+      Gout[p][k]->header->z_max = hi;
+      checkOutputRange(out_path[p][k], lo, hi);
+      if (GMT_Write_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_ONLY | GMT_GRID_ROW_BY_ROW, NULL,
+                  out_path[p][k], Gout[p][k]) != 0) {
+        fprintf(stderr, "Couldn't open %s for writing\n", out_path[p][k]);
+        exit(-1);
+      }
+    }
+  }
+
+  if ((lnv = (double *)malloc(nthreads * nx * sizeof(double))) == NULL) {
+    fprintf(stderr, "No memory for row buffers\n");
+    exit(-1);
+  }
+
+  report = ny / 100 > 0 ? ny / 100 : 1;
+
+  if (band_rows == 0) {
+    for (p = 0; p < nper; p++) {
+      for (k = 0; k < NOUT; k++) {
+        out[p][k] = Gout[p][k] == NULL ? NULL : Gout[p][k]->data;
+      }
+    }
+    ampBand(C, nper, Gvs30->data, Gregion == NULL ? NULL : Gregion->data,
+            out, lnv, ny, nx, nthreads, &ndone, ny, report);
+
+    /* Here the range is known before anything is written */
+    for (p = 0; p < nper; p++) {
+      for (k = 0; k < NOUT; k++) {
+        if (Gout[p][k] == NULL) {
+          continue;
+        }
+        lo = INFINITY;
+        hi = -INFINITY;
+        for (m = 0; m < nx * ny; m++) {
+          if (!isnan(out[p][k][m])) {
+            lo = fmin(lo, out[p][k][m]);
+            hi = fmax(hi, out[p][k][m]);
+          }
+        }
+        checkOutputRange(out_path[p][k], lo, hi);
+      }
+    }
+
+    fprintf(stderr, "Writing output files...");
+    for (p = 0; p < nper; p++) {
+      for (k = 0; k < NOUT; k++) {
+        if (Gout[p][k] != NULL &&
+            GMT_Write_Data(API, GMT_IS_GRID,
+                  GMT_IS_FILE, GMT_IS_SURFACE,
+                  GMT_CONTAINER_AND_DATA, NULL,
+                  out_path[p][k], Gout[p][k]) != 0) {
+          fprintf(stderr, "Couldn't write %s\n", out_path[p][k]);
+          exit(-1);
+        }
+      }
+    }
+    fprintf(stderr, "Done.\n");
+  } else {
+    /*
+     * Band mode: only band_rows rows of the inputs and of each of
+     * the outputs are ever in memory
+     */
+    if (band_rows > ny) {
+      band_rows = ny;
+    }
+    if ((vs30 = (float *)malloc((2 + nper * nout) * band_rows * nx *
+                                sizeof(float))) == NULL) {
+      fprintf(stderr, "No memory for %zd row bands\n", band_rows);
+      exit(-1);
+    }
+    region = Gregion == NULL ? NULL : vs30 + band_rows * nx;
+    m = 2;
+    for (p = 0; p < nper; p++) {
+      for (k = 0; k < NOUT; k++) {
+        out[p][k] = Gout[p][k] == NULL ? NULL : vs30 + (m++) * band_rows * nx;
+      }
+    }
+
+    for (row = 0; row < ny; row += nrows) {
+      nrows = ny - row < band_rows ? ny - row : band_rows;
+      for (m = 0; m < nrows; m++) {
+        if (GMT_Get_Row(API, row + m, Gvs30, vs30 + m * nx) ||
+            (Gregion != NULL && GMT_Get_Row(API, row + m, Gregion, region + m * nx))) {
+          fprintf(stderr, "Couldn't read row %zd of the input\n", row + m);
+          exit(-1);
+        }
+      }
+      ampBand(C, nper, vs30, region, out, lnv, nrows, nx, nthreads,
+              &ndone, ny, report);
+      for (p = 0; p < nper; p++) {
+        for (k = 0; k < NOUT; k++) {
+          if (Gout[p][k] == NULL) {
+            continue;
+          }
+          for (m = 0; m < nrows; m++) {
+            if (GMT_Put_Row(API, row + m, Gout[p][k], out[p][k] + m * nx)) {
+              fprintf(stderr, "Couldn't write row %zd of %s\n", row + m,
+                      out_path[p][k]);
+              exit(-1);
+            }
+          }
+        }
+      }
+    }
+    free(vs30);
+  }
+  free(lnv);
+
+  GMT_End_IO(API, GMT_IN, 0);
+  GMT_End_IO(API, GMT_OUT, 0);
+  GMT_Destroy_Session(API);
+
+  return 0;
+}
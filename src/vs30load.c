@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "libget.h"
+#include "grdutil.h"
+
+/*
+ * vs30load: measure the latency of a vs30query server
+ *
+ * Connects to the vs30query server listening on "socket" and sends
+ * it "batches" (default 1000) batches of "batch_size" (default 100)
+ * random points, one batch at a time, timing each from the moment it
+ * is sent to the moment the last answer comes back. The points are
+ * spread uniformly over the grid grid_file (the same one the server
+ * has), or over "wesn" (default -180/180/-56/84) if grid_file isn't
+ * given; "seed" (default 1) seeds the random numbers. Reports the
+ * 50th and 99th percentiles (and the maximum) of the time per batch
+ * and per point, and the number of points answered per second.
+ */
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static int byTime(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* The p-th percentile of the n sorted times t */
+static double percentile(const double *t, size_t n, double p) {
+  size_t k = (size_t)ceil(p / 100 * n);
+
+  return t[k == 0 ? 0 : k - 1];
+}
+
+int main(int ac, char **av) {
+
+  char socket_path[108];
+  char grid_path[256] = "";
+  char wesn_str[128] = "-180/180/-56/84";
+
+  size_t batches = 1000, batch_size = 100, b, i, k, len, off, nlines;
+  int seed = 1;
+  double wesn[4], t0, total, *t;
+  char *req, *buf;
+  size_t cap;
+  ssize_t n;
+  struct nativeGrid ng;
+  struct sockaddr_un addr;
+  struct pollfd pfd;
+  int fd;
+
+  setpar(ac, av);
+  if (!getStringPar("socket", socket_path, sizeof(socket_path))) {
+    fprintf(stderr, "socket is required\n");
+    exit(-1);
+  }
+  getpar("grid_file", "s", grid_path);
+  getpar("wesn", "s", wesn_str);
+  getpar("batches", "z", &batches);
+  getpar("batch_size", "z", &batch_size);
+  getpar("seed", "d", &seed);
+  endpar();
+
+  if (batches == 0 || batch_size == 0) {
+    fprintf(stderr, "batches and batch_size must be greater than 0\n");
+    exit(-1);
+  }
+  if (*grid_path != '\0') {
+    if (mapNativeGrid(grid_path, &ng, 0) != 0) {
+      exit(-1);
+    }
+    memcpy(wesn, ng.wesn, sizeof(wesn));
+    unmapNativeGrid(&ng);
+  } else if (sscanf(wesn_str, "%lf/%lf/%lf/%lf",
+                    wesn, wesn + 1, wesn + 2, wesn + 3) != 4) {
+    fprintf(stderr, "Can't read wesn=%s\n", wesn_str);
+    exit(-1);
+  }
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    fprintf(stderr, "Couldn't create a socket\n");
+    exit(-1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Couldn't connect to %s\n", socket_path);
+    exit(-1);
+  }
+
+  cap = 64 * batch_size;
+  if ((req = (char *)malloc(cap)) == NULL ||
+      (buf = (char *)malloc(cap)) == NULL ||
+      (t = (double *)malloc(batches * sizeof(double))) == NULL) {
+    fprintf(stderr, "No memory for %zd batches of %zd\n", batches, batch_size);
+    exit(-1);
+  }
+
+  srand48(seed);
+  total = now();
+  for (b = 0; b < batches; b++) {
+    len = 0;
+    for (i = 0; i < batch_size; i++) {
+      len += snprintf(req + len, cap - len, "%.6f %.6f\n",
+                      wesn[0] + drand48() * (wesn[1] - wesn[0]),
+                      wesn[2] + drand48() * (wesn[3] - wesn[2]));
+    }
+
+    /*
+     * Send and read at the same time; the server answers as the
+     * queries arrive, so with a big batch it could otherwise fill the
+     * socket and wait on us while we wait on it
+     */
+    t0 = now();
+    off = 0;
+    nlines = 0;
+    while (nlines < batch_size) {
+      pfd.fd = fd;
+      pfd.events = off < len ? POLLIN | POLLOUT : POLLIN;
+      if (poll(&pfd, 1, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fprintf(stderr, "Couldn't poll the server\n");
+        exit(-1);
+      }
+      if ((pfd.revents & POLLOUT) &&
+          (n = send(fd, req + off, len - off, MSG_DONTWAIT)) > 0) {
+        off += n;
+      }
+      if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+        if ((n = read(fd, buf, cap)) <= 0) {
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          fprintf(stderr, "Lost the server after %zd answers of batch %zd\n",
+                  nlines, b + 1);
+          exit(-1);
+        }
+        for (k = 0; k < (size_t)n; k++) {
+          nlines += buf[k] == '\n';
+        }
+      }
+    }
+    t[b] = now() - t0;
+  }
+  total = now() - total;
+  close(fd);
+
+  qsort(t, batches, sizeof(double), byTime);
+  printf("%zd batches of %zd points in %.3f s (%.0f points/s)\n",
+         batches, batch_size, total, batches * batch_size / total);
+  printf("per batch: p50 %.1f us  p99 %.1f us  max %.1f us\n",
+         1e6 * percentile(t, batches, 50), 1e6 * percentile(t, batches, 99),
+         1e6 * t[batches - 1]);
+  printf("per point: p50 %.3f us  p99 %.3f us\n",
+         1e6 * percentile(t, batches, 50) / batch_size,
+         1e6 * percentile(t, batches, 99) / batch_size);
+
+  free(req);
+  free(buf);
+  free(t);
+  return 0;
+}
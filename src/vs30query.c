@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libget.h"
+#include "grdutil.h"
+
+/*
+ * vs30query: answer Vs30 point queries from a resident grid
+ *
+ * grid_file is a GMT native binary float grid (e.g., made with
+ * "gmt grdconvert global_vs30.grd global_vs30.bin=bf", or the
+ * global_vs30.bin of an incremental build); it is memory-mapped
+ * once, so a query touches only the few grid points it needs and
+ * costs no more than a page fault the first time a part of the grid
+ * is used. It may also be a native grid of scaled 16-bit integers
+ * (e.g., global_vs30.bin=bs+s0.0625+o2048+n-32768; see VS30_SHORT in
+ * Constants.mk), which takes half the memory; the answers are then
+ * the stored values, within half a step (scale) of the originals.
+ *
+ * The protocol is text, a line per point: each query line is
+ *
+ *   lon lat
+ *
+ * and each answer line is "lon lat value", in the same order, with
+ * "NaN" outside the grid (and for a line that can't be read). The
+ * answers to all of the queries that arrive together are written
+ * together, so a client can send a batch of thousands of points and
+ * read back the whole batch.
+ *
+ * With "socket" (a path) the program listens on that Unix domain
+ * socket and serves each connection in its own process; otherwise it
+ * reads queries from stdin and writes answers to stdout. "method" is
+ * "bilinear" (the default) or "nearest". Bilinear interpolation
+ * works the way GMT's does: grid points that are NaN are left out
+ * and the weights of the others renormalized, unless they add up to
+ * less than 0.5, in which case the answer is NaN. Longitudes are
+ * wrapped onto grids that go all the way around the globe.
+ */
+
+struct query {
+  struct nativeGrid ng;
+  int bilinear;
+  int global;                   /* the grid goes around the globe */
+  long ncols;                   /* distinct columns (see main) */
+  double x0, y0;                /* lon of column 0, lat of row 0 */
+};
+
+/*
+ * Function lookup returns the value of the grid at (lon, lat)
+ */
+double lookup(const struct query *Q, double lon, double lat) {
+  const struct nativeGrid *ng = &Q->ng;
+  double fx, fy, tx, ty;
+  long nx = ng->nx, ny = ng->ny, ncols = Q->ncols, i, j, ii, jj;
+
+  if (Q->global) {
+    lon = Q->x0 + fmod(fmod(lon - Q->x0, 360) + 360, 360);
+  }
+  fx = (lon - Q->x0) / ng->inc[0];
+  fy = (Q->y0 - lat) / ng->inc[1];
+
+  /* Allow for roundoff at the edges */
+  if (fx < 0 && fx > -1e-6) fx = 0;
+  if (fy < 0 && fy > -1e-6) fy = 0;
+  if (fy > ny - 1 && fy < ny - 1 + 1e-6) fy = ny - 1;
+  if (!Q->global && fx > ncols - 1 && fx < ncols - 1 + 1e-6) fx = ncols - 1;
+
+  if (!(fy >= 0 && fy <= ny - 1) ||
+      !(fx >= 0 && (Q->global ? fx < ncols : fx <= ncols - 1))) {
+    return NAN;
+  }
+
+  if (!Q->bilinear) {
+    i = (long)(fx + 0.5);
+    j = (long)(fy + 0.5);
+    if (i >= ncols) i = Q->global ? 0 : ncols - 1;
+    return nativeValue(ng, j * nx + i);
+  }
+
+  /*
+   * The neighbors that get no weight may be off the grid; point them
+   * at this one (and the east neighbor wraps on a global grid)
+   */
+  i = (long)fx;
+  j = (long)fy;
+  tx = fx - i;
+  ty = fy - j;
+  ii = tx == 0 ? i : i + 1 < ncols ? i + 1 : 0;
+  jj = ty == 0 ? j : j + 1;
+  return bilinear(nativeValue(ng, j * nx + i), nativeValue(ng, j * nx + ii),
+                  nativeValue(ng, jj * nx + i), nativeValue(ng, jj * nx + ii),
+                  tx, ty);
+}
+
+/*
+ * Function serve answers the queries read from fd_in on fd_out until
+ * the input ends; each time a read returns, the complete lines in it
+ * are answered with a single write. Blank lines are ignored. Returns
+ * 0 at the end of the input, -1 on an error.
+ */
+int serve(const struct query *Q, int fd_in, int fd_out) {
+  size_t incap = 1 << 16, outcap = 1 << 18, inlen = 0, outlen, off;
+  char *in, *out, *line, *nl, *end, *p;
+  double lon, lat;
+  ssize_t got, n;
+
+  if ((in = (char *)malloc(incap)) == NULL ||
+      (out = (char *)malloc(outcap)) == NULL) {
+    fprintf(stderr, "No memory for buffers\n");
+    return -1;
+  }
+  for (;;) {
+    /* Leave room to end a last line that has no newline */
+    if ((got = read(fd_in, in + inlen, incap - inlen - 1)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    inlen += got;
+    if (got == 0 && inlen > 0) {
+      in[inlen++] = '\n';
+    }
+
+    outlen = 0;
+    for (line = in; (nl = memchr(line, '\n', in + inlen - line)) != NULL;
+         line = nl + 1) {
+      *nl = '\0';
+      if (strspn(line, " \t\r") == (size_t)(nl - line)) {
+        continue;
+      }
+      lon = strtod(line, &end);
+      if (end == line) {
+        lon = lat = NAN;
+      } else {
+        lat = strtod(p = end, &end);
+        if (end == p) {
+          lat = NAN;            /* no latitude; the answer is NaN */
+        }
+      }
+      if (outcap - outlen < 128) {
+        outcap *= 2;
+        if ((out = (char *)realloc(out, outcap)) == NULL) {
+          fprintf(stderr, "No memory for answers\n");
+          return -1;
+        }
+      }
+      outlen += snprintf(out + outlen, outcap - outlen, "%.8g %.8g %.7g\n",
+                         lon, lat, lookup(Q, lon, lat));
+    }
+    for (off = 0; off < outlen; off += n) {
+      if ((n = write(fd_out, out + off, outlen - off)) < 0) {
+        if (errno != EINTR) {
+          got = -1;
+          break;
+        }
+        n = 0;
+      }
+    }
+
+    /* Keep any partial line for the next read */
+    inlen -= line - in;
+    memmove(in, line, inlen);
+    if (inlen == incap - 1) {
+      incap *= 2;
+      if ((in = (char *)realloc(in, incap)) == NULL) {
+        fprintf(stderr, "No memory for queries\n");
+        return -1;
+      }
+    }
+    if (got <= 0) {
+      break;
+    }
+  }
+  free(in);
+  free(out);
+  return got == 0 ? 0 : -1;
+}
+
+int main(int ac, char **av) {
+
+  char grid_path[256];
+  char socket_path[108] = "";
+  char method[16] = "bilinear";
+
+  struct query Q;
+  struct sockaddr_un addr;
+  int sfd, cfd;
+
+  setpar(ac, av);
+  mstpar("grid_file", "s", grid_path);
+  getStringPar("socket", socket_path, sizeof(socket_path));
+  getStringPar("method", method, sizeof(method));
+  endpar();
+
+  memset(&Q, 0, sizeof(Q));
+  if (strcmp(method, "bilinear") == 0) {
+    Q.bilinear = 1;
+  } else if (strcmp(method, "nearest") != 0) {
+    fprintf(stderr, "Unknown method %s (use bilinear or nearest)\n", method);
+    exit(-1);
+  }
+  if (mapNativeGrid(grid_path, &Q.ng, 0) != 0) {
+    exit(-1);
+  }
+  madvise(Q.ng.base, Q.ng.length, MADV_RANDOM);
+
+  /* Where the grid points are: on the edges, or half a cell in */
+  Q.x0 = Q.ng.wesn[0] + (Q.ng.registration ? 0.5 * Q.ng.inc[0] : 0);
+  Q.y0 = Q.ng.wesn[3] - (Q.ng.registration ? 0.5 * Q.ng.inc[1] : 0);
+  Q.ncols = Q.ng.nx;
+  if (fabs(Q.ng.wesn[1] - Q.ng.wesn[0] - 360) < 0.5 * Q.ng.inc[0]) {
+    Q.global = 1;
+    /* On a gridline grid the last column repeats the first */
+    if (!Q.ng.registration) {
+      Q.ncols--;
+    }
+  }
+
+  if (*socket_path == '\0') {
+    return serve(&Q, 0, 1) == 0 ? 0 : -1;
+  }
+
+  if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    fprintf(stderr, "Couldn't create a socket\n");
+    exit(-1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+  unlink(socket_path);
+  if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(sfd, 64) != 0) {
+    fprintf(stderr, "Couldn't listen on %s\n", socket_path);
+    exit(-1);
+  }
+
+  /* Each connection gets its own process; they share the mapping */
+  signal(SIGCHLD, SIG_IGN);
+  fprintf(stderr, "Serving %s on %s\n", grid_path, socket_path);
+  for (;;) {
+    if ((cfd = accept(sfd, NULL, NULL)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Couldn't accept a connection\n");
+      exit(-1);
+    }
+    switch (fork()) {
+      case 0:
+        close(sfd);
+        exit(serve(&Q, cfd, cfd) == 0 ? 0 : -1);
+      case -1:
+        fprintf(stderr, "Couldn't fork for a connection\n");
+        break;
+      default:
+        break;
+    }
+    close(cfd);
+  }
+
+  return 0;
+}